@@ -2,21 +2,20 @@
 
 layout(location = 0) out vec4 fragColor;
 
-uniform mat4 um4mv;
-uniform mat4 um4p;
-
 in VertexData
 {
     vec3 N; // eye space normal
     vec3 L; // eye space light vector
     vec3 H; // eye space halfway vector
     vec2 texcoord;
+    flat int textureIndex;
 } vertexData;
 
-uniform sampler2D tex;
+// Every image is one layer, picked per draw or per instance
+uniform sampler2DArray textures;
 
 void main()
 {
-    vec3 texColor = texture(tex,vertexData.texcoord).rgb;
+    vec3 texColor = texture(textures, vec3(vertexData.texcoord, vertexData.textureIndex)).rgb;
     fragColor = vec4(texColor, 1.0);
 }
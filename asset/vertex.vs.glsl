@@ -1,11 +1,58 @@
 #version 410 core
 
 layout(location = 0) in vec3 iv3vertex;
-layout(location = 1) in vec2 iv2tex_coord;
-layout(location = 2) in vec3 iv3normal;
+layout(location = 1) in vec2 iv2tex_coord;	// float or half float, depending on the vertex layout
+layout(location = 2) in vec3 iv3normal;		// float or normalized GL_INT_2_10_10_10_REV (w dropped)
+layout(location = 3) in mat4 im4model;		// per-instance model matrix (crowd mode), uses locations 3-6
+layout(location = 7) in int ii1texture;		// per-instance texture array layer (crowd mode)
+layout(location = 8) in vec4 iv4placement;	// baked crowd: robot position, then phase offset in cycles
+layout(location = 9) in ivec3 ii3pose;		// baked crowd: texture array layer, part, clip
 
-uniform mat4 um4mv;
-uniform mat4 um4p;
+// Bound once, written once per frame
+layout(std140) uniform Camera
+{
+    mat4 um4v;
+    mat4 um4p;
+};
+
+// One range of a streamed buffer per draw; instanced draws read the instance attributes instead
+layout(std140) uniform Draw
+{
+    mat4 um4model;
+    int tex;			// texture array layer
+};
+
+uniform bool instanced;
+
+// Baked crowd: instanced, with each part's model matrix read from the baked poses. Every clip
+// has bakedSamples + 1 poses over its length, and every pose a matrix per part, four texels each.
+uniform bool baked;
+uniform samplerBuffer bakedPoses;
+uniform int bakedSamples;
+uniform int bakedParts;
+uniform vec2 bakedClips[BAKED_MAX_CLIPS];	// cycles per second, then 1 if the clip loops; the size is defined by main.cpp
+uniform float bakedTime;			// seconds
+
+mat4 bakedPose(int pose)
+{
+    int texel = ((ii3pose.z * (bakedSamples + 1) + pose) * bakedParts + ii3pose.y) * 4;
+    return mat4(texelFetch(bakedPoses, texel), texelFetch(bakedPoses, texel + 1), 
+        texelFetch(bakedPoses, texel + 2), texelFetch(bakedPoses, texel + 3));
+}
+
+// Blend of the two poses around the instance's place in its clip
+mat4 bakedModel()
+{
+    vec2 clip = bakedClips[ii3pose.z];
+    float cycle = bakedTime * clip.x + iv4placement.w;
+    cycle = clip.y > 0.5 ? fract(cycle) : clamp(cycle, 0.0, 1.0);
+    float position = cycle * float(bakedSamples);
+    int pose = min(int(position), bakedSamples - 1);
+    float t = position - float(pose);
+    mat4 model = bakedPose(pose) * (1.0 - t) + bakedPose(pose + 1) * t;
+    model[3].xyz += iv4placement.xyz;
+    return model;
+}
 
 out VertexData
 {
@@ -13,10 +60,14 @@ out VertexData
     vec3 L; // eye space light vector
     vec3 H; // eye space halfway vector
     vec2 texcoord;
+    flat int textureIndex;
 } vertexData;
 
 void main()
 {
-	gl_Position = um4p * um4mv * vec4(iv3vertex, 1.0);
+    mat4 model = !instanced ? um4model : baked ? bakedModel() : im4model;
+    mat4 mv = um4v * model;
+	gl_Position = um4p * mv * vec4(iv3vertex, 1.0);
     vertexData.texcoord = iv2tex_coord;
+    vertexData.textureIndex = !instanced ? tex : baked ? ii3pose.x : ii1texture;
 }
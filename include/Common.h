@@ -13,6 +13,7 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "TinyOBJ/tiny_obj_loader.h"
 #define STB_IMAGE_IMPLEMENTATION
+#define STBI_NO_FAILURE_STRINGS	// the failure string is a global, and loader threads decode in parallel
 #include "STB/stb_image.h"
 
 #ifdef _MSC_VER
@@ -28,6 +29,7 @@
 #include "GLM/glm.hpp"
 #include "GLM/gtc/matrix_transform.hpp"
 #include "GLM/gtc/type_ptr.hpp"
+#include "GLM/gtc/packing.hpp"
 
 #include <cstdio>
 #include <cstring>
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "Common.h"
+#include "JointRotation.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+// Keyframed motion of a rig, loaded from a text file (see asset/anim):
+//   clip <length in seconds> loop|once
+//   track <joint> rotate|shift
+//   <time> <x> <y> <z>
+// Rotation keys are Euler degrees in eulerOrientation()'s order, turned into quaternions
+// on load; shift keys move the joint on its parent. Keys of a track are in increasing time
+// and every track keeps its keys contiguous. Joints a clip has no track for keep their
+// rest pose. '#' starts a comment.
+struct JointTrack
+{
+	int joint;
+	bool rotates;						// keys in orientations, else in shifts
+	std::vector<float> times;
+	std::vector<glm::quat> orientations;
+	std::vector<glm::vec3> shifts;
+};
+
+struct AnimationClip
+{
+	std::string name;					// file name without its extension
+	float length = 0.0f;
+	bool looping = false;
+	std::vector<JointTrack> tracks;
+};
+
+// joints names the rig's joints by index
+inline bool loadAnimationClip(const std::string& path, const std::vector<std::string>& joints, AnimationClip& clip)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		std::cout << "Failed to open animation " << path << std::endl;
+		return false;
+	}
+	size_t nameStart = path.find_last_of("/\\") + 1;
+	clip = AnimationClip();
+	clip.name = path.substr(nameStart, path.find_last_of('.') - nameStart);
+
+	int lineNumber = 0;
+	auto fail = [&](const char* expected) {
+		std::cout << "Failed to load animation " << path << ":" << lineNumber << ": expected " << expected << std::endl;
+		return false;
+	};
+	std::string line;
+	while (std::getline(file, line))
+	{
+		lineNumber++;
+		std::istringstream words(line.substr(0, line.find('#')));
+		std::string word;
+		if (!(words >> word))
+			continue;
+		if (word == "clip")
+		{
+			std::string mode;
+			if (!(words >> clip.length >> mode) || clip.length <= 0.0f || (mode != "loop" && mode != "once"))
+				return fail("clip <length> loop|once");
+			clip.looping = mode == "loop";
+		}
+		else if (word == "track")
+		{
+			std::string joint, kind;
+			if (!(words >> joint >> kind) || (kind != "rotate" && kind != "shift"))
+				return fail("track <joint> rotate|shift");
+			auto found = std::find(joints.begin(), joints.end(), joint);
+			if (found == joints.end())
+				return fail("the name of a joint");
+			JointTrack track;
+			track.joint = (int)(found - joints.begin());
+			track.rotates = kind == "rotate";
+			clip.tracks.push_back(track);
+		}
+		else
+		{
+			std::istringstream key(line.substr(0, line.find('#')));
+			float time;
+			glm::vec3 value;
+			if (clip.tracks.empty() || !(key >> time >> value.x >> value.y >> value.z))
+				return fail("<time> <x> <y> <z> after a track line");
+			JointTrack& track = clip.tracks.back();
+			if (!track.times.empty() && time <= track.times.back())
+				return fail("a key later than the one before");
+			track.times.push_back(time);
+			if (track.rotates)
+				track.orientations.push_back(eulerOrientation(value.x, value.y, value.z));
+			else
+				track.shifts.push_back(value);
+		}
+	}
+	if (clip.length <= 0.0f)
+		return fail("a clip line");
+	for (const JointTrack& track : clip.tracks)
+		if (track.times.empty())
+			return fail("keys in every track");
+	return true;
+}
+
+// Key k with times[k] <= time < times[k + 1], or the first or last key outside them. cursor
+// holds the key found last time: playback moves forward a tick at a time, so the answer is
+// almost always that key or the next, and the binary search only runs after a jump.
+inline int findKey(const std::vector<float>& times, float time, int& cursor)
+{
+	int last = (int)times.size() - 1;
+	for (int k = cursor; k <= std::min(cursor + 1, last); ++k)
+		if (times[k] <= time && (k == last || time < times[k + 1]))
+			return cursor = k;
+	int k = (int)(std::upper_bound(times.begin(), times.end(), time) - times.begin()) - 1;
+	return cursor = std::max(k, 0);
+}
+
+// Playback of one clip, with a key cursor per track
+class ClipPlayer
+{
+public:
+	const AnimationClip* clip = NULL;
+	float time = 0.0f;
+
+	void start(const AnimationClip* played)
+	{
+		clip = played;
+		time = 0.0f;
+		cursors.assign(clip != NULL ? clip->tracks.size() : 0, 0);
+	}
+
+	// Looping clips wrap around, the others hold their last pose
+	void advance(float seconds)
+	{
+		if (clip == NULL)
+			return;
+		time += seconds;
+		time = clip->looping ? std::fmod(time, clip->length) : std::min(time, clip->length);
+	}
+
+	// Write the clip's pose over the joints it has tracks for
+	void sample(glm::vec3* shifts, glm::quat* orientations)
+	{
+		if (clip == NULL)
+			return;
+		for (size_t i = 0; i < clip->tracks.size(); ++i)
+		{
+			const JointTrack& track = clip->tracks[i];
+			int k = findKey(track.times, time, cursors[i]);
+			int next = std::min(k + 1, (int)track.times.size() - 1);
+			float t = next == k ? 0.0f : glm::clamp((time - track.times[k]) / (track.times[next] - track.times[k]), 0.0f, 1.0f);
+			if (track.rotates)
+				orientations[track.joint] = slerpJoint(track.orientations[k], track.orientations[next], t);
+			else
+				shifts[track.joint] = glm::mix(track.shifts[k], track.shifts[next], t);
+		}
+	}
+
+private:
+	std::vector<int> cursors;
+};
+
+// Plays one clip at a time and crossfades into the next: for fade seconds after play(),
+// the pose blends from the clip that was playing, which keeps running, to the new one
+class ClipBlender
+{
+public:
+	void play(const AnimationClip* clip, float fade)
+	{
+		if (clip == current.clip)
+			return;
+		fadeLength = fade;
+		if (clip == previous.clip && blend < 1.0f)
+		{
+			// Turning back halfway: fade back from where the blend is
+			std::swap(current, previous);
+			blend = 1.0f - blend;
+			return;
+		}
+		previous = current;
+		current.start(clip);
+		blend = fade > 0.0f ? 0.0f : 1.0f;
+	}
+
+	void advance(float seconds)
+	{
+		current.advance(seconds);
+		if (blend < 1.0f)
+		{
+			previous.advance(seconds);
+			blend = std::min(blend + seconds / fadeLength, 1.0f);
+		}
+	}
+
+	// Pose count joints, whose shifts and orientations hold the rest pose on entry
+	void sample(glm::vec3* shifts, glm::quat* orientations, int count)
+	{
+		if (blend < 1.0f)
+		{
+			fromShifts.assign(shifts, shifts + count);
+			fromOrientations.assign(orientations, orientations + count);
+			previous.sample(fromShifts.data(), fromOrientations.data());
+		}
+		current.sample(shifts, orientations);
+		if (blend < 1.0f)
+			for (int i = 0; i < count; ++i)
+			{
+				shifts[i] = glm::mix(fromShifts[i], shifts[i], blend);
+				orientations[i] = slerpJoint(fromOrientations[i], orientations[i], blend);
+			}
+	}
+
+	// Whether clip shows in the pose, fading in or out included
+	bool playing(const AnimationClip* clip) const
+	{
+		return current.clip == clip || (blend < 1.0f && previous.clip == clip);
+	}
+
+private:
+	ClipPlayer current;
+	ClipPlayer previous;
+	float blend = 1.0f;					// weight of current
+	float fadeLength = 0.0f;
+	std::vector<glm::vec3> fromShifts;
+	std::vector<glm::quat> fromOrientations;
+};
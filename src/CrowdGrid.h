@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Common.h"
+#include "Frustum.h"
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Uniform grid over robot root positions. Only occupied cells are stored, each with the
+// box of the roots it holds, so a frustum query costs one box test per occupied cell and
+// then touches robots only in cells that straddle a plane. Positions are relative to a
+// common origin passed to every query, so robots moving together never need a rebuild.
+class CrowdGrid
+{
+public:
+	void build(const std::vector<glm::vec3>& positions, float size)
+	{
+		cellSize = size;
+		cells.clear();
+		cellIndex.clear();
+		for (size_t robot = 0; robot < positions.size(); ++robot)
+		{
+			Cell& cell = cells[cellFor(positions[robot])];
+			cell.low = glm::min(cell.low, positions[robot]);
+			cell.high = glm::max(cell.high, positions[robot]);
+			cell.robots.push_back((int)robot);
+		}
+	}
+
+	// Robots whose roots, moved by offset and grown by reach, may be in the frustum:
+	// those in cells wholly inside go to inside, the rest need their own test
+	void query(const Frustum& frustum, const glm::vec3& offset, float reach, std::vector<int>& inside, std::vector<int>& intersecting) const
+	{
+		for (const Cell& cell : cells)
+		{
+			Frustum::Test test = frustum.classifyBox(cell.low + offset - reach, cell.high + offset + reach);
+			if (test == Frustum::Inside)
+				inside.insert(inside.end(), cell.robots.begin(), cell.robots.end());
+			else if (test == Frustum::Intersects)
+				intersecting.insert(intersecting.end(), cell.robots.begin(), cell.robots.end());
+		}
+	}
+
+private:
+	struct Cell
+	{
+		glm::vec3 low;
+		glm::vec3 high;
+		std::vector<int> robots;
+	};
+
+	float cellSize = 1.0f;
+	std::vector<Cell> cells;
+	std::unordered_map<int64_t, int> cellIndex;		// packed (x, z) cell coordinates -> cells
+
+	int cellFor(const glm::vec3& position)
+	{
+		int64_t x = (int64_t)std::floor(position.x / cellSize), z = (int64_t)std::floor(position.z / cellSize);
+		int64_t key = (x << 32) ^ (z & 0xFFFFFFFF);
+		auto found = cellIndex.find(key);
+		if (found != cellIndex.end())
+			return found->second;
+		cellIndex[key] = cells.size();
+		cells.push_back({ position, position, {} });
+		return cells.size() - 1;
+	}
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Common.h"
+
+#include <cstdint>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <xmmintrin.h>
+	#define FRUSTUM_SSE 1
+#endif
+
+// View frustum as six inward-facing planes (left, right, bottom, top, near, far) taken
+// from the rows of projection * view. Planes are normalized, so a plane's dot product
+// with a point is its signed distance and spheres test against their radius directly.
+struct Frustum
+{
+	glm::vec4 planes[6];
+
+	Frustum() {}
+
+	explicit Frustum(const glm::mat4& viewProjection)
+	{
+		glm::vec4 rows[4];
+		for (int r = 0; r < 4; ++r)
+			rows[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			planes[2 * axis + 0] = rows[3] + rows[axis];
+			planes[2 * axis + 1] = rows[3] - rows[axis];
+		}
+		for (glm::vec4& plane : planes)
+			plane /= glm::length(glm::vec3(plane));
+	}
+
+	enum Test { Outside, Intersects, Inside };
+
+	// Each plane is checked against the box corner farthest along its normal and the one opposite
+	Test classifyBox(const glm::vec3& low, const glm::vec3& high) const
+	{
+		glm::vec3 center = 0.5f * (low + high), extent = 0.5f * (high - low);
+		Test result = Inside;
+		for (const glm::vec4& plane : planes)
+		{
+			float distance = glm::dot(glm::vec3(plane), center) + plane.w;
+			float radius = glm::dot(glm::abs(glm::vec3(plane)), extent);
+			if (distance < -radius)
+				return Outside;
+			if (distance < radius)
+				result = Intersects;
+		}
+		return result;
+	}
+
+	bool sphereVisible(const glm::vec4& sphere) const
+	{
+		for (const glm::vec4& plane : planes)
+			if (glm::dot(glm::vec3(plane), glm::vec3(sphere)) + plane.w < -sphere.w)
+				return false;
+		return true;
+	}
+};
+
+// Test count spheres (xyz center, w radius) against the frustum, writing 1 for visible
+// and 0 for culled into visible; returns how many are visible. With SSE, four spheres
+// are transposed into x/y/z/r registers and go through all six planes together.
+inline int cullSpheres(const Frustum& frustum, const glm::vec4* spheres, int count, uint8_t* visible)
+{
+	int passed = 0;
+	int i = 0;
+#ifdef FRUSTUM_SSE
+	__m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+	for (int p = 0; p < 6; ++p)
+	{
+		planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+		planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+		planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+		planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+	}
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(&spheres[i + 0].x);
+		__m128 y = _mm_loadu_ps(&spheres[i + 1].x);
+		__m128 z = _mm_loadu_ps(&spheres[i + 2].x);
+		__m128 r = _mm_loadu_ps(&spheres[i + 3].x);
+		_MM_TRANSPOSE4_PS(x, y, z, r);
+		__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), r);
+		__m128 inside = _mm_cmpeq_ps(r, r);		// all ones unless the radius is NaN
+		for (int p = 0; p < 6; ++p)
+		{
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], x), _mm_mul_ps(planeY[p], y)), _mm_add_ps(_mm_mul_ps(planeZ[p], z), planeW[p]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+		}
+		int mask = _mm_movemask_ps(inside);
+		for (int k = 0; k < 4; ++k)
+		{
+			visible[i + k] = (mask >> k) & 1;
+			passed += visible[i + k];
+		}
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		visible[i] = frustum.sphereVisible(spheres[i]);
+		passed += visible[i];
+	}
+	return passed;
+}
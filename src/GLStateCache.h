@@ -0,0 +1,194 @@
+#pragma once
+
+#include "Common.h"
+
+#include <cstdint>
+
+// Shadow copy of the GL bindings the renderer sets every frame. Calls that would set
+// what is already set are dropped and counted. Anything that binds behind the cache's
+// back (texture uploads, the streamer, ImGui's renderer) runs between frames, so
+// beginFrame() forgets all bindings. Uniform values belong to the program object and
+// are kept, as long as the uniforms the cache tracks are only ever set through it.
+#define STATE_TEXTURE_UNITS 8
+#define STATE_UNIFORM_BINDINGS 8
+#define STATE_UNIFORM_LOCATIONS 32		// int uniforms at higher locations are passed straight through
+
+enum StateCall
+{
+	StateProgram,
+	StateVertexArray,
+	StateTexture,
+	StateUniformBuffer,
+	StateUniform,
+	StateCallCount
+};
+
+class GLStateCache
+{
+public:
+	GLStateCache()
+	{
+		forgetBindings();
+	}
+
+	// Close the previous frame's counters and forget every binding
+	void beginFrame()
+	{
+		for (int i = 0; i < StateCallCount; ++i)
+		{
+			lastIssued[i] = issued[i];
+			lastSkipped[i] = skipped[i];
+			totalIssued[i] += issued[i];
+			totalSkipped[i] += skipped[i];
+			issued[i] = skipped[i] = 0;
+		}
+		frames++;
+		forgetBindings();
+	}
+
+	void useProgram(GLuint name)
+	{
+		if (!changed(StateProgram, program, name))
+			return;
+		glUseProgram(name);
+		if (name != uniformProgram)
+		{
+			uniformProgram = name;
+			for (int i = 0; i < STATE_UNIFORM_LOCATIONS; ++i)
+				uniformKnown[i] = false;
+		}
+	}
+
+	void bindVertexArray(GLuint name)
+	{
+		if (changed(StateVertexArray, vertexArray, name))
+			glBindVertexArray(name);
+	}
+
+	// One target per unit is tracked; the renderer never binds two targets to the same unit
+	void bindTexture(int unit, GLenum target, GLuint name)
+	{
+		if (unit >= STATE_TEXTURE_UNITS)
+		{
+			glActiveTexture(GL_TEXTURE0 + unit);
+			activeUnit = unit;
+			glBindTexture(target, name);
+			issued[StateTexture]++;
+			return;
+		}
+		if (!changed(StateTexture, textures[unit], name))
+			return;
+		if (activeUnit != (GLuint)unit)
+		{
+			glActiveTexture(GL_TEXTURE0 + unit);
+			activeUnit = unit;
+		}
+		glBindTexture(target, name);
+	}
+
+	void bindUniformRange(GLuint binding, GLuint buffer, GLintptr offset, GLsizeiptr size)
+	{
+		if (binding < STATE_UNIFORM_BINDINGS)
+		{
+			UniformRange& bound = uniformBuffers[binding];
+			if (bound.buffer == buffer && bound.offset == offset && bound.size == size)
+			{
+				skipped[StateUniformBuffer]++;
+				return;
+			}
+			bound = { buffer, offset, size };
+		}
+		glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+		issued[StateUniformBuffer]++;
+	}
+
+	// For the program in use
+	void uniform1i(GLint location, int value)
+	{
+		if (location >= 0 && location < STATE_UNIFORM_LOCATIONS)
+		{
+			if (uniformKnown[location] && uniformValues[location] == value)
+			{
+				skipped[StateUniform]++;
+				return;
+			}
+			uniformKnown[location] = true;
+			uniformValues[location] = value;
+		}
+		glUniform1i(location, value);
+		issued[StateUniform]++;
+	}
+
+	void drawStats() const
+	{
+		ImGui::Text("GL state calls, last frame");
+		for (int i = 0; i < StateCallCount; ++i)
+			ImGui::Text("  %-15s %5d issued %5d skipped", callName(i), lastIssued[i], lastSkipped[i]);
+	}
+
+	void report() const
+	{
+		if (frames <= 1)
+			return;
+		double measured = (double)(frames - 1);
+		printf("GL state calls per frame (issued / skipped):\n");
+		for (int i = 0; i < StateCallCount; ++i)
+			printf("  %-18s %8.1f / %8.1f\n", callName(i), totalIssued[i] / measured, totalSkipped[i] / measured);
+	}
+
+private:
+	static const GLuint UNKNOWN = 0xFFFFFFFFu;
+
+	struct UniformRange
+	{
+		GLuint buffer;
+		GLintptr offset;
+		GLsizeiptr size;
+	};
+
+	GLuint program = UNKNOWN;
+	GLuint vertexArray = UNKNOWN;
+	GLuint activeUnit = UNKNOWN;
+	GLuint textures[STATE_TEXTURE_UNITS];
+	UniformRange uniformBuffers[STATE_UNIFORM_BINDINGS];
+	GLuint uniformProgram = UNKNOWN;
+	bool uniformKnown[STATE_UNIFORM_LOCATIONS] = {};
+	int uniformValues[STATE_UNIFORM_LOCATIONS] = {};
+
+	int issued[StateCallCount] = {};
+	int skipped[StateCallCount] = {};
+	int lastIssued[StateCallCount] = {};
+	int lastSkipped[StateCallCount] = {};
+	int64_t totalIssued[StateCallCount] = {};
+	int64_t totalSkipped[StateCallCount] = {};
+	int64_t frames = 0;
+
+	void forgetBindings()
+	{
+		program = UNKNOWN;
+		vertexArray = UNKNOWN;
+		activeUnit = UNKNOWN;
+		for (int i = 0; i < STATE_TEXTURE_UNITS; ++i)
+			textures[i] = UNKNOWN;
+		for (int i = 0; i < STATE_UNIFORM_BINDINGS; ++i)
+			uniformBuffers[i] = { UNKNOWN, -1, -1 };
+	}
+
+	bool changed(StateCall call, GLuint& current, GLuint name)
+	{
+		if (current == name)
+		{
+			skipped[call]++;
+			return false;
+		}
+		current = name;
+		issued[call]++;
+		return true;
+	}
+
+	static const char* callName(int call)
+	{
+		static const char* names[StateCallCount] = { "Program", "Vertex array", "Texture", "Uniform buffer", "Uniform" };
+		return names[call];
+	}
+};
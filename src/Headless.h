@@ -0,0 +1,213 @@
+#pragma once
+
+#include "Common.h"
+
+#include <cstdint>
+#include <vector>
+#ifndef _MSC_VER
+	#include <EGL/egl.h>
+	#include <EGL/eglext.h>
+#endif
+
+// Offscreen GL 4.1 core context for display-less machines: an EGL context with no
+// surface (Mesa's surfaceless platform when available) rendering into an FBO
+class HeadlessContext
+{
+public:
+	int width = 0;
+	int height = 0;
+
+	bool create(int fboWidth, int fboHeight, bool srgb)
+	{
+#ifndef _MSC_VER
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay != NULL)
+			display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		if (display == EGL_NO_DISPLAY)
+			display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API))
+		{
+			std::cout << "Failed to initialize EGL" << std::endl;
+			return false;
+		}
+
+		EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		EGLConfig config = NULL;
+		EGLint configCount = 0;
+		if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0)
+			config = NULL;	// EGL_NO_CONFIG_KHR: fine, nothing is ever presented
+		EGLint contextAttributes[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 4,
+			EGL_CONTEXT_MINOR_VERSION, 1,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+		if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+		{
+			std::cout << "Failed to create a surfaceless OpenGL 4.1 context" << std::endl;
+			return false;
+		}
+		if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+		{
+			std::cout << "Failed to initialize GLAD" << std::endl;
+			return false;
+		}
+
+		width = fboWidth;
+		height = fboHeight;
+		glGenRenderbuffers(2, renderbuffers);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+		glRenderbufferStorage(GL_RENDERBUFFER, srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			std::cout << "Headless framebuffer is incomplete" << std::endl;
+			return false;
+		}
+		glViewport(0, 0, width, height);
+		return true;
+#else
+		std::cout << "Headless mode needs EGL, which this platform does not provide" << std::endl;
+		return false;
+#endif
+	}
+
+	// Loader for entry points glad does not cover
+	GLADloadproc procAddress() const
+	{
+#ifndef _MSC_VER
+		return (GLADloadproc)eglGetProcAddress;
+#else
+		return NULL;
+#endif
+	}
+
+	// Rows top to bottom, RGB8
+	std::vector<unsigned char> readPixels()
+	{
+		std::vector<unsigned char> pixels((size_t)width * height * 3);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+		size_t rowBytes = (size_t)width * 3;
+		for (int y = 0; y < height / 2; ++y)
+			std::swap_ranges(pixels.begin() + y * rowBytes, pixels.begin() + (y + 1) * rowBytes, pixels.begin() + (height - 1 - y) * rowBytes);
+		return pixels;
+	}
+
+	void destroy()
+	{
+#ifndef _MSC_VER
+		if (context != EGL_NO_CONTEXT)
+		{
+			glDeleteFramebuffers(1, &framebuffer);
+			glDeleteRenderbuffers(2, renderbuffers);
+			eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(display, context);
+			context = EGL_NO_CONTEXT;
+		}
+		if (display != EGL_NO_DISPLAY)
+			eglTerminate(display);
+		display = EGL_NO_DISPLAY;
+#endif
+	}
+
+private:
+#ifndef _MSC_VER
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+#endif
+	GLuint framebuffer = 0;
+	GLuint renderbuffers[2] = { 0, 0 };
+};
+
+uint32_t pngCrc(uint32_t crc, const unsigned char* data, size_t size)
+{
+	static uint32_t table[256];
+	if (table[1] == 0)
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+void pngChunk(FILE* fp, const char* type, const std::vector<unsigned char>& data)
+{
+	unsigned char length[4] = { (unsigned char)(data.size() >> 24), (unsigned char)(data.size() >> 16), (unsigned char)(data.size() >> 8), (unsigned char)data.size() };
+	uint32_t crc = pngCrc(pngCrc(0, (const unsigned char*)type, 4), data.data(), data.size());
+	unsigned char crcBytes[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+	fwrite(length, 1, 4, fp);
+	fwrite(type, 1, 4, fp);
+	fwrite(data.data(), 1, data.size(), fp);
+	fwrite(crcBytes, 1, 4, fp);
+}
+
+// Minimal RGB8 PNG writer for frame dumps. Rows go unfiltered into stored (uncompressed)
+// deflate blocks: bigger files than zlib would give, but no extra dependency.
+bool writePNG(const char* path, int width, int height, const unsigned char* rgb)
+{
+	FILE* fp = fopen(path, "wb");
+	if (fp == NULL)
+		return false;
+
+	auto bigEndian = [](std::vector<unsigned char>& out, uint32_t value) {
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back((unsigned char)(value >> shift));
+	};
+
+	std::vector<unsigned char> header;
+	bigEndian(header, width);
+	bigEndian(header, height);
+	header.insert(header.end(), { 8, 2, 0, 0, 0 });	// 8-bit RGB, deflate, adaptive filtering, no interlace
+
+	size_t rowBytes = (size_t)width * 3;
+	std::vector<unsigned char> raw;
+	raw.reserve((rowBytes + 1) * height);
+	for (int y = 0; y < height; ++y)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), rgb + y * rowBytes, rgb + (y + 1) * rowBytes);
+	}
+
+	std::vector<unsigned char> zlib = { 0x78, 0x01 };
+	uint32_t a = 1, b = 0;
+	for (size_t offset = 0; ; )
+	{
+		size_t blockSize = std::min(raw.size() - offset, (size_t)65535);
+		bool last = offset + blockSize == raw.size();
+		zlib.insert(zlib.end(), { (unsigned char)last, (unsigned char)blockSize, (unsigned char)(blockSize >> 8), (unsigned char)~blockSize, (unsigned char)(~blockSize >> 8) });
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+		for (size_t i = offset; i < offset + blockSize; ++i)
+		{
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		offset += blockSize;
+		if (last)
+			break;
+	}
+	bigEndian(zlib, (b << 16) | a);
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite(signature, 1, 8, fp);
+	pngChunk(fp, "IHDR", header);
+	pngChunk(fp, "IDAT", zlib);
+	pngChunk(fp, "IEND", {});
+	bool ok = ferror(fp) == 0;
+	fclose(fp);
+	return ok;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Common.h"
+#include "GLM/gtc/quaternion.hpp"
+
+// Orientation of Euler angles in degrees: turn about the vertical axis y, then the depth
+// axis z, then the x axis
+inline glm::quat eulerOrientation(float x, float y, float z)
+{
+	return glm::angleAxis(glm::radians(y), glm::vec3(0.0f, 1.0f, 0.0f))
+		* glm::angleAxis(glm::radians(z), glm::vec3(0.0f, 0.0f, 1.0f))
+		* glm::angleAxis(glm::radians(x), glm::vec3(1.0f, 0.0f, 0.0f));
+}
+
+// Joint orientations are unit quaternions. Interpolating them is the per-frame cost of
+// every animated joint, so slerpJoint() avoids acos/sin: it runs nlerp with t remapped by
+// a polynomial fit of slerp's angle (after Kapoulkine's "Approximating slerp"). It stays
+// within 0.05 degrees of exact slerp for any pair of orientations, and within 0.001 degrees
+// for the few degrees a joint turns between two simulation ticks.
+inline glm::quat slerpJoint(const glm::quat& from, const glm::quat& to, float t)
+{
+	float cosine = glm::dot(from, to);
+	float d = std::abs(cosine);
+	float a = 1.0904f + d * (-3.2452f + d * (3.55645f - d * 1.43519f));
+	float b = 0.848013f + d * (-1.06021f + d * 0.215638f);
+	float k = a * (t - 0.5f) * (t - 0.5f) + b;
+	float u = t + t * (t - 0.5f) * (t - 1.0f) * k;
+	glm::quat target = cosine < 0.0f ? -to : to;	// the shorter way round
+	glm::quat blended = from * (1.0f - u) + target * u;
+	return blended * (1.0f / glm::length(blended));
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#ifndef _MSC_VER
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+// Binary mesh cache written next to each .obj on first run:
+// [MeshCacheHeader][vertexCount * vertexStride bytes of interleaved vertices][indexCount * uint32 indices]
+// Simplified levels of detail go to their own files of the same format, Name.lodN.mesh.
+#define MESH_CACHE_MAGIC 0x4853454D		// "MESH"
+#define MESH_CACHE_VERSION 4
+#define MESH_CACHE_EXTENSION ".mesh"
+
+struct MeshCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t sourceTime;		// mtime of the .obj this cache was built from
+	uint64_t sourceSize;	// size of the .obj this cache was built from
+	uint32_t vertexCount;
+	uint32_t vertexStride;
+	uint32_t indexCount;
+	uint32_t vertexLayout;	// VertexLayout the vertex blob is stored in
+	uint32_t lodGrid;		// clustering grid resolution a level of detail was simplified with, 0 for the full mesh
+};
+
+// Read-only view of a whole file, memory mapped where the platform allows it
+class MappedFile
+{
+public:
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other) noexcept : data(other.data), size(other.size), buffer(std::move(other.buffer))
+	{
+		other.data = nullptr;
+		other.size = 0;
+	}
+	MappedFile& operator=(MappedFile&& other) noexcept
+	{
+		if (this != &other)
+		{
+			close();
+			data = other.data;
+			size = other.size;
+			buffer = std::move(other.buffer);
+			other.data = nullptr;
+			other.size = 0;
+		}
+		return *this;
+	}
+	~MappedFile() { close(); }
+
+	bool open(const char* path)
+	{
+		close();
+#ifndef _MSC_VER
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			return false;
+		}
+		void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED)
+			return false;
+		data = (const unsigned char*)mapped;
+		size = st.st_size;
+#else
+		FILE* fp = fopen(path, "rb");
+		if (fp == NULL)
+			return false;
+		fseek(fp, 0, SEEK_END);
+		buffer.resize(ftell(fp));
+		fseek(fp, 0, SEEK_SET);
+		size_t readSize = fread(buffer.data(), 1, buffer.size(), fp);
+		fclose(fp);
+		if (readSize != buffer.size() || buffer.empty())
+			return false;
+		data = buffer.data();
+		size = buffer.size();
+#endif
+		return true;
+	}
+
+	void close()
+	{
+#ifndef _MSC_VER
+		if (data != nullptr)
+			munmap((void*)data, size);
+#endif
+		buffer.clear();
+		data = nullptr;
+		size = 0;
+	}
+
+private:
+	std::vector<unsigned char> buffer;	// fallback storage when mmap is unavailable
+};
+
+std::string replaceExtension(const char* sourcePath, const char* extension)
+{
+	std::string path(sourcePath);
+	size_t dot = path.rfind('.');
+	return (dot == std::string::npos ? path : path.substr(0, dot)) + extension;
+}
+
+std::string meshCachePath(const char* objPath, int lod)
+{
+	return replaceExtension(objPath, lod == 0 ? MESH_CACHE_EXTENSION : (".lod" + std::to_string(lod) + MESH_CACHE_EXTENSION).c_str());
+}
+
+bool sourceStamp(const char* path, int64_t& time, uint64_t& size)
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return false;
+	time = (int64_t)st.st_mtime;
+	size = (uint64_t)st.st_size;
+	return true;
+}
+
+// Map a cache file and check it still matches its source .obj
+bool openMeshCache(const char* objPath, MappedFile& file, int lod = 0)
+{
+	int64_t time;
+	uint64_t size;
+	if (!sourceStamp(objPath, time, size) || !file.open(meshCachePath(objPath, lod).c_str()))
+		return false;
+
+	const MeshCacheHeader* header = (const MeshCacheHeader*)file.data;
+	bool valid = file.size >= sizeof(MeshCacheHeader) &&
+		header->magic == MESH_CACHE_MAGIC &&
+		header->version == MESH_CACHE_VERSION &&
+		header->sourceTime == time &&
+		header->sourceSize == size &&
+		file.size == sizeof(MeshCacheHeader) + (size_t)header->vertexCount * header->vertexStride + (size_t)header->indexCount * sizeof(uint32_t);
+	if (!valid)
+		file.close();
+	return valid;
+}
+
+bool writeMeshCache(const char* objPath, uint32_t vertexLayout, const void* vertices, uint32_t vertexCount, uint32_t vertexStride, const uint32_t* indices, uint32_t indexCount, int lod = 0, uint32_t lodGrid = 0)
+{
+	MeshCacheHeader header = {};
+	header.magic = MESH_CACHE_MAGIC;
+	header.version = MESH_CACHE_VERSION;
+	header.vertexCount = vertexCount;
+	header.vertexStride = vertexStride;
+	header.indexCount = indexCount;
+	header.vertexLayout = vertexLayout;
+	header.lodGrid = lodGrid;
+	if (!sourceStamp(objPath, header.sourceTime, header.sourceSize))
+		return false;
+
+	FILE* fp = fopen(meshCachePath(objPath, lod).c_str(), "wb");
+	if (fp == NULL)
+		return false;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		fwrite(vertices, vertexStride, vertexCount, fp) == vertexCount &&
+		fwrite(indices, sizeof(uint32_t), indexCount, fp) == indexCount;
+	fclose(fp);
+	return ok;
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "Common.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// Per-frame CPU scope timers, GL_TIME_ELAPSED GPU timers and a rolling frame-time history.
+// CPU time may be added from any thread; everything else runs on the context thread.
+// GPU queries are double buffered: a query set is read back only when the frame that
+// reuses it begins, and only if the result is already available, so reading never stalls.
+#define PROFILER_MAX_SCOPES 16
+#define PROFILER_HISTORY 240		// frames kept for the graph and percentiles
+#define PROFILER_GPU_FRAMES 2		// query sets in flight
+#define PROFILER_SMOOTHING 0.1f		// weight of the newest frame in the displayed averages
+
+class Profiler
+{
+public:
+	explicit Profiler(std::initializer_list<const char*> names)
+	{
+		for (const char* name : names)
+			if (scopeCount < PROFILER_MAX_SCOPES)
+				scopeNames[scopeCount++] = name;
+	}
+
+	// Start a new frame: close the CPU totals of the previous one and collect finished GPU queries
+	void beginFrame()
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (frameCount > 0)
+		{
+			float frameMs = (float)std::chrono::duration<double, std::milli>(now - frameStart).count();
+			history[historyNext] = frameMs;
+			historyNext = (historyNext + 1) % PROFILER_HISTORY;
+			historyCount = std::min(historyCount + 1, PROFILER_HISTORY);
+
+			for (int i = 0; i < scopeCount; ++i)
+			{
+				double ms = cpuNanos[i].exchange(0, std::memory_order_relaxed) / 1e6;
+				cpuMs[i] += PROFILER_SMOOTHING * ((float)ms - cpuMs[i]);
+				cpuTotal[i] += ms;
+			}
+			measuredFrames++;
+		}
+		frameStart = now;
+
+		if (!queriesCreated)
+		{
+			glGenQueries(PROFILER_GPU_FRAMES * PROFILER_MAX_SCOPES, &queries[0][0]);
+			queriesCreated = true;
+		}
+		currentSet = frameCount % PROFILER_GPU_FRAMES;
+		for (int i = 0; i < scopeCount; ++i)
+		{
+			if (!gpuPending[currentSet][i])
+				continue;
+			GLint available = 0;
+			glGetQueryObjectiv(queries[currentSet][i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint64 nanos = 0;
+				glGetQueryObjectui64v(queries[currentSet][i], GL_QUERY_RESULT, &nanos);
+				gpuMs[i] += PROFILER_SMOOTHING * ((float)(nanos / 1e6) - gpuMs[i]);
+				gpuTotal[i] += nanos / 1e6;
+				gpuSamples[i]++;
+			}
+			gpuPending[currentSet][i] = false;	// an unfinished result is dropped, never waited for
+		}
+		frameCount++;
+	}
+
+	const char* name(int scope) const
+	{
+		return scopeNames[scope];
+	}
+
+	void addCpu(int scope, int64_t nanos)
+	{
+		cpuNanos[scope].fetch_add(nanos, std::memory_order_relaxed);
+	}
+
+	// GL_TIME_ELAPSED queries cannot nest; a GPU scope opened inside another one is not timed
+	void beginGpu(int scope)
+	{
+		if (activeGpu >= 0 || !queriesCreated)
+			return;
+		glBeginQuery(GL_TIME_ELAPSED, queries[currentSet][scope]);
+		activeGpu = scope;
+	}
+
+	void endGpu(int scope)
+	{
+		if (activeGpu != scope)
+			return;
+		glEndQuery(GL_TIME_ELAPSED);
+		gpuPending[currentSet][scope] = true;
+		gpuUsed[scope] = true;
+		activeGpu = -1;
+	}
+
+	void drawWindow()
+	{
+		ImGui::SetNextWindowPos(ImVec2(20, 180), ImGuiCond_FirstUseEver);
+		ImGui::Begin("Profiler", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+
+		std::vector<float> sorted(history, history + historyCount);
+		std::sort(sorted.begin(), sorted.end());
+		float p50 = percentile(sorted, 0.50f), p95 = percentile(sorted, 0.95f), p99 = percentile(sorted, 0.99f);
+		float worst = sorted.empty() ? 0.0f : sorted.back();
+		ImGui::Text("Frame  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f ms", p50, p95, p99, worst);
+
+		char overlay[32];
+		snprintf(overlay, sizeof(overlay), "last %d frames", historyCount);
+		ImGui::PlotLines("##frametime", history, historyCount, historyCount < PROFILER_HISTORY ? 0 : historyNext, overlay, 0.0f, std::max(worst, 1.0f), ImVec2(320, 70));
+
+		if (ImGui::BeginTable("scopes", 3, ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit))
+		{
+			ImGui::TableSetupColumn("Scope");
+			ImGui::TableSetupColumn("CPU ms");
+			ImGui::TableSetupColumn("GPU ms");
+			ImGui::TableHeadersRow();
+			float cpuSum = 0.0f, gpuSum = 0.0f;
+			for (int i = 0; i < scopeCount; ++i)
+			{
+				ImGui::TableNextRow();
+				ImGui::TableNextColumn();
+				ImGui::TextUnformatted(scopeNames[i]);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.3f", cpuMs[i]);
+				ImGui::TableNextColumn();
+				if (gpuUsed[i])
+					ImGui::Text("%.3f", gpuMs[i]);
+				else
+					ImGui::TextUnformatted("-");
+				cpuSum += cpuMs[i];
+				gpuSum += gpuUsed[i] ? gpuMs[i] : 0.0f;
+			}
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted("Total");
+			ImGui::TableNextColumn();
+			ImGui::Text("%.3f", cpuSum);
+			ImGui::TableNextColumn();
+			ImGui::Text("%.3f", gpuSum);
+			ImGui::EndTable();
+		}
+		ImGui::End();
+	}
+
+	// Whole-run averages, for headless logs
+	void report() const
+	{
+		std::vector<float> sorted(history, history + historyCount);
+		std::sort(sorted.begin(), sorted.end());
+		printf("Frame time over last %d frames: p50 %.3f, p95 %.3f, p99 %.3f ms\n", historyCount, percentile(sorted, 0.50f), percentile(sorted, 0.95f), percentile(sorted, 0.99f));
+		for (int i = 0; i < scopeCount; ++i)
+		{
+			printf("  %-18s CPU %8.3f ms", scopeNames[i], measuredFrames > 0 ? cpuTotal[i] / measuredFrames : 0.0);
+			if (gpuSamples[i] > 0)
+				printf("   GPU %8.3f ms", gpuTotal[i] / gpuSamples[i]);
+			printf("\n");
+		}
+	}
+
+private:
+	const char* scopeNames[PROFILER_MAX_SCOPES];
+	int scopeCount = 0;
+
+	std::atomic<int64_t> cpuNanos[PROFILER_MAX_SCOPES] = {};
+	float cpuMs[PROFILER_MAX_SCOPES] = {};
+	double cpuTotal[PROFILER_MAX_SCOPES] = {};
+
+	GLuint queries[PROFILER_GPU_FRAMES][PROFILER_MAX_SCOPES];
+	bool gpuPending[PROFILER_GPU_FRAMES][PROFILER_MAX_SCOPES] = {};
+	bool gpuUsed[PROFILER_MAX_SCOPES] = {};
+	float gpuMs[PROFILER_MAX_SCOPES] = {};
+	double gpuTotal[PROFILER_MAX_SCOPES] = {};
+	int gpuSamples[PROFILER_MAX_SCOPES] = {};
+	bool queriesCreated = false;
+	int currentSet = 0;
+	int activeGpu = -1;
+
+	std::chrono::steady_clock::time_point frameStart;
+	int64_t frameCount = 0;
+	int64_t measuredFrames = 0;
+	float history[PROFILER_HISTORY] = {};
+	int historyNext = 0;
+	int historyCount = 0;
+
+	static float percentile(const std::vector<float>& sorted, float p)
+	{
+		if (sorted.empty())
+			return 0.0f;
+		return sorted[std::min((size_t)(p * sorted.size()), sorted.size() - 1)];
+	}
+};
+
+// Times its own lifetime into one profiler scope, on the GPU as well when asked,
+// and into the trace under the scope's name
+class ScopedTimer
+{
+public:
+	ScopedTimer(Profiler& owner, int id, bool gpu = false) : profiler(owner), scope(id), timed(gpu), trace(owner.name(id)), start(std::chrono::steady_clock::now())
+	{
+		if (timed)
+			profiler.beginGpu(scope);
+	}
+
+	~ScopedTimer()
+	{
+		if (timed)
+			profiler.endGpu(scope);
+		profiler.addCpu(scope, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+private:
+	Profiler& profiler;
+	int scope;
+	bool timed;
+	TraceScope trace;
+	std::chrono::steady_clock::time_point start;
+};
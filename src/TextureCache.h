@@ -0,0 +1,126 @@
+#pragma once
+
+#include "MeshCache.h"
+#include <algorithm>
+
+// Preprocessed texture cache written next to each image the first time the
+// compressed texture policy is used:
+// [TextureCacheHeader][level 0 blob][level 1 blob]...
+#define TEXTURE_CACHE_MAGIC 0x58455443		// "CTEX"
+#define TEXTURE_CACHE_VERSION 1
+#define TEXTURE_CACHE_EXTENSION ".ctex"
+#define TEXTURE_CACHE_MAX_LEVELS 16
+
+struct TextureCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t sourceTime;		// mtime of the image this cache was built from
+	uint64_t sourceSize;	// size of the image this cache was built from
+	uint32_t internalFormat;	// GL compressed internal format of every level
+	uint32_t width;
+	uint32_t height;
+	uint32_t levelCount;
+	uint32_t levelSizes[TEXTURE_CACHE_MAX_LEVELS];
+};
+
+std::string textureCachePath(const char* imagePath)
+{
+	return replaceExtension(imagePath, TEXTURE_CACHE_EXTENSION);
+}
+
+// Map a cache file and check it still matches its source image and format
+bool openTextureCache(const char* imagePath, uint32_t internalFormat, MappedFile& file)
+{
+	int64_t time;
+	uint64_t size;
+	if (!sourceStamp(imagePath, time, size) || !file.open(textureCachePath(imagePath).c_str()))
+		return false;
+
+	const TextureCacheHeader* header = (const TextureCacheHeader*)file.data;
+	bool valid = file.size >= sizeof(TextureCacheHeader) &&
+		header->magic == TEXTURE_CACHE_MAGIC &&
+		header->version == TEXTURE_CACHE_VERSION &&
+		header->sourceTime == time &&
+		header->sourceSize == size &&
+		header->internalFormat == internalFormat &&
+		header->levelCount > 0 && header->levelCount <= TEXTURE_CACHE_MAX_LEVELS;
+	if (valid)
+	{
+		size_t expected = sizeof(TextureCacheHeader);
+		for (uint32_t level = 0; level < header->levelCount; ++level)
+			expected += header->levelSizes[level];
+		valid = file.size == expected;
+	}
+	if (!valid)
+		file.close();
+	return valid;
+}
+
+const unsigned char* textureCacheLevel(const MappedFile& file, uint32_t level)
+{
+	const TextureCacheHeader* header = (const TextureCacheHeader*)file.data;
+	const unsigned char* data = file.data + sizeof(TextureCacheHeader);
+	for (uint32_t i = 0; i < level; ++i)
+		data += header->levelSizes[i];
+	return data;
+}
+
+bool writeTextureCache(const char* imagePath, uint32_t internalFormat, uint32_t width, uint32_t height, const std::vector<std::vector<unsigned char>>& levels)
+{
+	if (levels.empty() || levels.size() > TEXTURE_CACHE_MAX_LEVELS)
+		return false;
+
+	TextureCacheHeader header = {};
+	header.magic = TEXTURE_CACHE_MAGIC;
+	header.version = TEXTURE_CACHE_VERSION;
+	header.internalFormat = internalFormat;
+	header.width = width;
+	header.height = height;
+	header.levelCount = (uint32_t)levels.size();
+	for (size_t level = 0; level < levels.size(); ++level)
+		header.levelSizes[level] = (uint32_t)levels[level].size();
+	if (!sourceStamp(imagePath, header.sourceTime, header.sourceSize))
+		return false;
+
+	FILE* fp = fopen(textureCachePath(imagePath).c_str(), "wb");
+	if (fp == NULL)
+		return false;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (size_t level = 0; ok && level < levels.size(); ++level)
+		ok = fwrite(levels[level].data(), 1, levels[level].size(), fp) == levels[level].size();
+	fclose(fp);
+	return ok;
+}
+
+// Box-filtered RGBA8 mip chain, level 0 included
+std::vector<std::vector<unsigned char>> buildMipChain(const unsigned char* rgba, int width, int height)
+{
+	std::vector<std::vector<unsigned char>> levels;
+	levels.emplace_back(rgba, rgba + (size_t)width * height * 4);
+	while (width > 1 || height > 1)
+	{
+		int nextWidth = width > 1 ? width / 2 : 1;
+		int nextHeight = height > 1 ? height / 2 : 1;
+		const std::vector<unsigned char>& src = levels.back();
+		std::vector<unsigned char> dst((size_t)nextWidth * nextHeight * 4);
+		for (int y = 0; y < nextHeight; ++y)
+		{
+			int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+			for (int x = 0; x < nextWidth; ++x)
+			{
+				int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+				for (int c = 0; c < 4; ++c)
+				{
+					int sum = src[((size_t)y0 * width + x0) * 4 + c] + src[((size_t)y0 * width + x1) * 4 + c] +
+						src[((size_t)y1 * width + x0) * 4 + c] + src[((size_t)y1 * width + x1) * 4 + c];
+					dst[((size_t)y * nextWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+		levels.push_back(std::move(dst));
+		width = nextWidth;
+		height = nextHeight;
+	}
+	return levels;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "Common.h"
+#include "TextureCache.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+#include <map>
+#include <memory>
+
+// Textures requested at runtime are decoded on a worker thread, then copied to
+// the GPU a slice at a time through a small ring of pixel unpack buffers so no
+// single frame pays for a whole 1024x1024 upload. Each PBO is reused only once
+// the fence placed after its last glTexSubImage3D has signalled. Streamed images
+// land in spare layers of the shared texture array; the caller flips its layer
+// table once every level is resident.
+#define STREAM_PBO_COUNT 3
+#define STREAM_PBO_SIZE (1 << 20)
+#define STREAM_BYTES_PER_FRAME (2 << 20)
+
+struct StreamLevel
+{
+	int width;
+	int height;
+	const unsigned char* data;
+	size_t rowBytes;	// bytes per row of texels, or per row of 4x4 blocks when compressed
+	int rowHeight;		// texel rows per stored row: 1, or 4 when compressed
+	int rowCount;
+};
+
+struct StreamJob
+{
+	int slot;
+	unsigned generation;
+	std::string path;
+	bool compressed = false;
+	std::vector<std::vector<unsigned char>> pixels;	// decoded RGBA8 mip chain
+	MappedFile cache;								// or preprocessed compressed levels
+	std::vector<StreamLevel> levels;
+	int layer = -1;
+	int level = 0;
+	int row = 0;
+};
+
+class TextureStreamer
+{
+public:
+	size_t bytesPerFrame = STREAM_BYTES_PER_FRAME;
+
+	// onReady(slot, layer) runs on the context thread: first with the placeholder
+	// layer when a request starts, then with the streamed layer once it is complete
+	void init(GLuint arrayTexture, GLenum arrayFormat, bool arrayCompressed, int arraySize, int uploadUnit, 
+		std::vector<int> spareLayers, int placeholder, std::function<void(int, int)> onReady)
+	{
+		textureArray = arrayTexture;
+		internalFormat = arrayFormat;
+		compressed = arrayCompressed;
+		size = arraySize;
+		scratchUnit = uploadUnit;
+		freeLayers = spareLayers;
+		placeholderLayer = placeholder;
+		ready = onReady;
+
+		glGenBuffers(STREAM_PBO_COUNT, pbo);
+		for (int i = 0; i < STREAM_PBO_COUNT; ++i)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, STREAM_PBO_SIZE, NULL, GL_STREAM_DRAW);
+			fence[i] = 0;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	// Show the placeholder for slot right away and start decoding path in the background
+	void request(int slot, const char* path)
+	{
+		unsigned generation = ++generations[slot];
+		ready(slot, placeholderLayer);
+
+		std::string file(path);
+		GLenum format = compressed ? internalFormat : 0;
+		worker.submit([this, slot, generation, file, format] {
+			tracer.nameThread("Texture streamer");
+			TraceScope trace("Decode streamed texture");
+			std::shared_ptr<StreamJob> job = std::make_shared<StreamJob>();
+			job->slot = slot;
+			job->generation = generation;
+			job->path = file;
+			if (format != 0 && openTextureCache(file.c_str(), format, job->cache))
+				describeCompressed(*job);
+			else
+				decodeRGBA(*job);
+			decoded.push(job);
+		});
+	}
+
+	// Give a layer that is no longer referenced back to the streamer
+	void release(int layer)
+	{
+		freeLayers.push_back(layer);
+	}
+
+	// Call once per frame on the context thread
+	void update()
+	{
+		std::shared_ptr<StreamJob> job;
+		while (decoded.tryPop(job))
+		{
+			if (job->levels.empty() || job->levels[0].width != size || job->levels[0].height != size)
+				std::cout << "Failed to stream texture " << job->path << std::endl;
+			else
+				active.push_back(job);
+		}
+
+		size_t budget = bytesPerFrame;
+		while (!active.empty() && budget > 0)
+		{
+			job = active.front();
+			if (job->generation != generations[job->slot])
+			{
+				if (job->layer >= 0)
+					release(job->layer);
+				active.pop_front();
+				continue;
+			}
+			if (job->layer < 0)
+			{
+				if (freeLayers.empty())
+					break;	// every spare layer is still on screen
+				job->layer = freeLayers.back();
+				freeLayers.pop_back();
+			}
+
+			size_t copied = 0;
+			if (!uploadSlice(*job, copied))
+				break;	// every PBO still in flight, try again next frame
+			budget = copied >= budget ? 0 : budget - copied;
+
+			if (job->level == (int)job->levels.size())
+			{
+				ready(job->slot, job->layer);
+				active.pop_front();
+			}
+		}
+	}
+
+private:
+	CompletionQueue<std::shared_ptr<StreamJob>> decoded;
+	std::deque<std::shared_ptr<StreamJob>> active;
+	std::map<int, unsigned> generations;
+	std::vector<int> freeLayers;
+	std::function<void(int, int)> ready;
+	GLuint textureArray = 0;
+	GLenum internalFormat = GL_RGBA8;
+	bool compressed = false;
+	int size = 0;
+	int placeholderLayer = 0;
+	int scratchUnit = 0;
+	GLuint pbo[STREAM_PBO_COUNT];
+	GLsync fence[STREAM_PBO_COUNT];
+	int nextPBO = 0;
+	ThreadPool worker{ 1 };	// declared last so it stops before the queues it feeds are destroyed
+
+	static void decodeRGBA(StreamJob& job)
+	{
+		int width, height, n;
+		stbi_uc* data = stbi_load(job.path.c_str(), &width, &height, &n, 4);
+		if (data == NULL)
+			return;
+		job.pixels = buildMipChain(data, width, height);
+		stbi_image_free(data);
+		for (size_t level = 0; level < job.pixels.size(); ++level)
+		{
+			int w = std::max(width >> level, 1), h = std::max(height >> level, 1);
+			job.levels.push_back({ w, h, job.pixels[level].data(), (size_t)w * 4, 1, h });
+		}
+	}
+
+	static void describeCompressed(StreamJob& job)
+	{
+		const TextureCacheHeader* header = (const TextureCacheHeader*)job.cache.data;
+		job.compressed = true;
+		for (uint32_t level = 0; level < header->levelCount; ++level)
+		{
+			int w = std::max((int)header->width >> level, 1), h = std::max((int)header->height >> level, 1);
+			int blockRows = (h + 3) / 4;
+			job.levels.push_back({ w, h, textureCacheLevel(job.cache, level), header->levelSizes[level] / blockRows, 4, blockRows });
+		}
+	}
+
+	// Copy as many rows of the current level as fit one PBO and issue the sub-image upload.
+	// RGBA rows headed for a compressed array are encoded by the driver on upload.
+	bool uploadSlice(StreamJob& job, size_t& copied)
+	{
+		int slot = nextPBO;
+		if (fence[slot] != 0)
+		{
+			if (glClientWaitSync(fence[slot], 0, 0) == GL_TIMEOUT_EXPIRED)
+				return false;
+			glDeleteSync(fence[slot]);
+			fence[slot] = 0;
+		}
+
+		const StreamLevel& level = job.levels[job.level];
+		int rows = std::min(level.rowCount - job.row, std::max((int)(STREAM_PBO_SIZE / level.rowBytes), 1));
+		copied = (size_t)rows * level.rowBytes;
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[slot]);
+		void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, copied, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		memcpy(mapped, level.data + (size_t)job.row * level.rowBytes, copied);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		glActiveTexture(GL_TEXTURE0 + scratchUnit);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureArray);
+		int y = job.row * level.rowHeight;
+		int height = std::min(rows * level.rowHeight, level.height - y);
+		if (job.compressed)
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, job.level, 0, y, job.layer, level.width, height, 1, internalFormat, copied, NULL);
+		else
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, job.level, 0, y, job.layer, level.width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		nextPBO = (nextPBO + 1) % STREAM_PBO_COUNT;
+
+		job.row += rows;
+		if (job.row == level.rowCount)
+		{
+			job.level++;
+			job.row = 0;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// Chrome trace_event capture (load the JSON in chrome://tracing or Perfetto).
+// Every thread appends complete events to its own chain of fixed-size blocks and
+// publishes each one with a release store of the block's count, so recording never
+// takes a lock and a dump may run from any thread while others keep recording.
+// Event names must outlive the dump: pass string literals or other static strings.
+#define TRACE_BLOCK_EVENTS 4096
+
+struct TraceEvent
+{
+	const char* name;
+	int64_t start;		// ns since the trace epoch
+	int64_t duration;	// ns
+};
+
+struct TraceBlock
+{
+	TraceEvent events[TRACE_BLOCK_EVENTS];
+	std::atomic<int> count{ 0 };
+	std::atomic<TraceBlock*> next{ nullptr };
+};
+
+// One per recording thread, never freed so a dump still sees threads that have exited
+struct TraceThread
+{
+	int id = 0;
+	std::atomic<const char*> name{ nullptr };
+	TraceThread* nextThread = nullptr;
+	TraceBlock* tail = nullptr;		// owner thread only
+	TraceBlock head;
+};
+
+class Tracer
+{
+public:
+	std::atomic<bool> enabled{ false };
+
+	int64_t now() const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	void nameThread(const char* name)
+	{
+		local().name.store(name, std::memory_order_release);
+	}
+
+	void record(const char* name, int64_t start, int64_t end)
+	{
+		TraceThread& thread = local();
+		TraceBlock* block = thread.tail;
+		int count = block->count.load(std::memory_order_relaxed);
+		if (count == TRACE_BLOCK_EVENTS)
+		{
+			TraceBlock* fresh = new TraceBlock;
+			block->next.store(fresh, std::memory_order_release);
+			thread.tail = block = fresh;
+			count = 0;
+		}
+		block->events[count] = { name, start, end - start };
+		block->count.store(count + 1, std::memory_order_release);
+	}
+
+	// Write everything published so far as trace_event JSON
+	bool write(const char* path) const
+	{
+		FILE* fp = fopen(path, "w");
+		if (fp == NULL)
+			return false;
+		fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"GPA2022_Assignment1\"}}");
+		size_t eventCount = 0;
+		for (const TraceThread* thread = threads.load(std::memory_order_acquire); thread != nullptr; thread = thread->nextThread)
+		{
+			const char* name = thread->name.load(std::memory_order_acquire);
+			if (name != nullptr)
+			{
+				fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", thread->id);
+				writeString(fp, name);
+				fprintf(fp, "}}");
+			}
+			for (const TraceBlock* block = &thread->head; block != nullptr; block = block->next.load(std::memory_order_acquire))
+			{
+				int count = block->count.load(std::memory_order_acquire);
+				for (int i = 0; i < count; ++i)
+				{
+					const TraceEvent& event = block->events[i];
+					fprintf(fp, ",\n{\"name\":");
+					writeString(fp, event.name);
+					fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", thread->id, event.start / 1000.0, event.duration / 1000.0);
+				}
+				eventCount += count;
+			}
+		}
+		fprintf(fp, "\n]}\n");
+		bool ok = ferror(fp) == 0;
+		fclose(fp);
+		if (ok)
+			printf("Wrote %zu trace events to %s\n", eventCount, path);
+		return ok;
+	}
+
+private:
+	std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	std::atomic<TraceThread*> threads{ nullptr };
+	std::atomic<int> nextId{ 1 };
+
+	TraceThread& local()
+	{
+		thread_local TraceThread* thread = nullptr;
+		if (thread == nullptr)
+		{
+			thread = new TraceThread;
+			thread->id = nextId.fetch_add(1);
+			thread->tail = &thread->head;
+			thread->nextThread = threads.load(std::memory_order_relaxed);
+			while (!threads.compare_exchange_weak(thread->nextThread, thread, std::memory_order_release, std::memory_order_relaxed))
+				;
+		}
+		return *thread;
+	}
+
+	static void writeString(FILE* fp, const char* text)
+	{
+		fputc('"', fp);
+		for (const char* c = text; *c != '\0'; ++c)
+		{
+			if (*c == '"' || *c == '\\')
+				fputc('\\', fp);
+			if ((unsigned char)*c >= 0x20)
+				fputc(*c, fp);
+		}
+		fputc('"', fp);
+	}
+};
+
+Tracer tracer;
+
+// Records its own lifetime as one trace event while tracing is enabled
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* scopeName) : name(scopeName), start(tracer.enabled.load(std::memory_order_relaxed) ? tracer.now() : -1) {}
+
+	~TraceScope()
+	{
+		if (start >= 0)
+			tracer.record(name, start, tracer.now());
+	}
+
+private:
+	const char* name;
+	int64_t start;
+};
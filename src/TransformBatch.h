@@ -0,0 +1,197 @@
+#pragma once
+
+#include "Common.h"
+#include "GLM/gtc/quaternion.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <xmmintrin.h>
+	#define TRANSFORM_SSE 1
+#endif
+
+// Batched joint transforms. A joint's local matrix is
+//   translate(shift + translate) * mat4_cast(orientation) * translate(redirect)
+// its world matrix is parent world * local and its model matrix is world * scale(scale).
+// composeJoints() builds all three straight from the parameters, without intermediate
+// mat4s: the translations and scale are folded into the 3x3 rotation and translation
+// column, and the constant bottom row is never computed. Every remaining sum runs in the
+// order of the equivalent glm::mat4_cast/translate/scale products, so the results match
+// theirs. No trigonometry is involved; it is all multiplies and adds. With SSE, four
+// joints go through together, one per lane.
+
+// Structure-of-arrays view of a rig, indexed by joint
+struct JointArrays
+{
+	const int* parents;				// -1 for a root
+	const glm::vec3* shifts;
+	const glm::vec3* translates;
+	const glm::vec3* redirects;
+	const glm::vec3* scales;
+	const glm::quat* orientations;	// unit length
+	glm::mat4* local;
+	glm::mat4* world;
+	glm::mat4* model;
+};
+
+// Written once for float and for four-lane SSE values, with the same sums in the same order
+template <typename T>
+struct JointMath
+{
+	// Rotation of quaternion (x, y, z, w) into r[column * 3 + row], as glm::mat3_cast builds it
+	static void rotation(T x, T y, T z, T w, T one, T two, T* r)
+	{
+		T xx = x * x, yy = y * y, zz = z * z;
+		T xz = x * z, xy = x * y, yz = y * z;
+		T wx = w * x, wy = w * y, wz = w * z;
+		r[0] = one - two * (yy + zz);
+		r[1] = two * (xy + wz);
+		r[2] = two * (xz - wy);
+		r[3] = two * (xy - wz);
+		r[4] = one - two * (xx + zz);
+		r[5] = two * (yz + wx);
+		r[6] = two * (xz + wy);
+		r[7] = two * (yz - wx);
+		r[8] = one - two * (xx + yy);
+	}
+
+	// Local matrix as a 3x3 rotation and a translation column, then parent * local and
+	// world * scale; p and world are 3x3 plus translation, twelve entries each
+	static void compose(const T* r, const T* t, const T* d, const T* p, const T* s, T* local, T* world, T* model)
+	{
+		for (int i = 0; i < 9; ++i)
+			local[i] = r[i];
+		for (int row = 0; row < 3; ++row)
+			local[9 + row] = r[row] * d[0] + r[3 + row] * d[1] + r[6 + row] * d[2] + t[row];
+		for (int col = 0; col < 4; ++col)
+			for (int row = 0; row < 3; ++row)
+			{
+				T sum = p[row] * local[col * 3] + p[3 + row] * local[col * 3 + 1] + p[6 + row] * local[col * 3 + 2];
+				world[col * 3 + row] = col == 3 ? sum + p[9 + row] : sum;
+			}
+		for (int col = 0; col < 4; ++col)
+			for (int row = 0; row < 3; ++row)
+				model[col * 3 + row] = col == 3 ? world[9 + row] : world[col * 3 + row] * s[col];
+	}
+};
+
+namespace transform_detail
+{
+#ifdef TRANSFORM_SSE
+	// Four floats, one per joint, for JointMath
+	struct Lanes
+	{
+		__m128 v;
+		Lanes() {}
+		Lanes(__m128 value) : v(value) {}
+		Lanes operator+(Lanes other) const { return _mm_add_ps(v, other.v); }
+		Lanes operator-(Lanes other) const { return _mm_sub_ps(v, other.v); }
+		Lanes operator*(Lanes other) const { return _mm_mul_ps(v, other.v); }
+	};
+#endif
+
+	inline void storeAffine(const float* entries, glm::mat4& m)
+	{
+		for (int col = 0; col < 4; ++col)
+			m[col] = glm::vec4(entries[col * 3], entries[col * 3 + 1], entries[col * 3 + 2], col == 3 ? 1.0f : 0.0f);
+	}
+
+	inline void composeOne(const JointArrays& joints, int i)
+	{
+		static const glm::mat4 identity(1.0f);
+		const glm::quat& q = joints.orientations[i];
+		glm::vec3 t = joints.shifts[i] + joints.translates[i];
+		const glm::mat4& parent = joints.parents[i] >= 0 ? joints.world[joints.parents[i]] : identity;
+		float r[9], p[12], local[12], world[12], model[12];
+		JointMath<float>::rotation(q.x, q.y, q.z, q.w, 1.0f, 2.0f, r);
+		for (int col = 0; col < 4; ++col)
+			for (int row = 0; row < 3; ++row)
+				p[col * 3 + row] = parent[col][row];
+		JointMath<float>::compose(r, &t.x, &joints.redirects[i].x, p, &joints.scales[i].x, local, world, model);
+		storeAffine(local, joints.local[i]);
+		storeAffine(world, joints.world[i]);
+		storeAffine(model, joints.model[i]);
+	}
+
+#ifdef TRANSFORM_SSE
+	// Write lane k of each entry register as joint k's column-major affine matrix
+	inline void storeAffine4(const Lanes* entries, glm::mat4* const* out, int lanes)
+	{
+		for (int col = 0; col < 4; ++col)
+		{
+			__m128 x = entries[col * 3].v, y = entries[col * 3 + 1].v, z = entries[col * 3 + 2].v;
+			__m128 w = _mm_set1_ps(col == 3 ? 1.0f : 0.0f);
+			_MM_TRANSPOSE4_PS(x, y, z, w);
+			__m128 columns[4] = { x, y, z, w };
+			for (int k = 0; k < lanes; ++k)
+				_mm_storeu_ps(&(*out[k])[col][0], columns[k]);
+		}
+	}
+
+	// Joints first..first+lanes-1; unused lanes repeat the last joint and are not stored
+	inline void composeFour(const JointArrays& joints, int first, int lanes)
+	{
+		static const glm::mat4 identity(1.0f);
+		int index[4];
+		const glm::mat4* parent[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			index[k] = first + (k < lanes ? k : lanes - 1);
+			int p = joints.parents[index[k]];
+			parent[k] = p >= 0 ? &joints.world[p] : &identity;
+		}
+		auto gather = [&](auto field) {
+			return Lanes(_mm_setr_ps(field(index[0]), field(index[1]), field(index[2]), field(index[3])));
+		};
+
+		const glm::quat* q = joints.orientations;
+		Lanes r[9];
+		JointMath<Lanes>::rotation(gather([&](int i) { return q[i].x; }), gather([&](int i) { return q[i].y; }),
+			gather([&](int i) { return q[i].z; }), gather([&](int i) { return q[i].w; }), _mm_set1_ps(1.0f), _mm_set1_ps(2.0f), r);
+
+		Lanes t[3], d[3], s[4], p[12];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			t[axis] = gather([&](int i) { return joints.shifts[i][axis] + joints.translates[i][axis]; });
+			d[axis] = gather([&](int i) { return joints.redirects[i][axis]; });
+			s[axis] = gather([&](int i) { return joints.scales[i][axis]; });
+		}
+		s[3] = _mm_set1_ps(1.0f);
+		for (int col = 0; col < 4; ++col)
+		{
+			__m128 x = _mm_loadu_ps(&(*parent[0])[col][0]);
+			__m128 y = _mm_loadu_ps(&(*parent[1])[col][0]);
+			__m128 z = _mm_loadu_ps(&(*parent[2])[col][0]);
+			__m128 w = _mm_loadu_ps(&(*parent[3])[col][0]);
+			_MM_TRANSPOSE4_PS(x, y, z, w);
+			p[col * 3] = x;
+			p[col * 3 + 1] = y;
+			p[col * 3 + 2] = z;
+		}
+
+		Lanes local[12], world[12], model[12];
+		JointMath<Lanes>::compose(r, t, d, p, s, local, world, model);
+		glm::mat4* out[4];
+		for (int k = 0; k < 4; ++k)
+			out[k] = &joints.local[index[k]];
+		storeAffine4(local, out, lanes);
+		for (int k = 0; k < 4; ++k)
+			out[k] = &joints.world[index[k]];
+		storeAffine4(world, out, lanes);
+		for (int k = 0; k < 4; ++k)
+			out[k] = &joints.model[index[k]];
+		storeAffine4(model, out, lanes);
+	}
+#endif
+}
+
+// Joints [begin, end) must not be each other's parents, and their parents must be composed
+// already: in a parent-before-child rig, call it once per depth level
+inline void composeJoints(const JointArrays& joints, int begin, int end)
+{
+	int i = begin;
+#ifdef TRANSFORM_SSE
+	for (; i < end; i += 4)
+		transform_detail::composeFour(joints, i, std::min(end - i, 4));
+#endif
+	for (; i < end; ++i)
+		transform_detail::composeOne(joints, i);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+
+// Single-writer, single-reader triple buffer. The writer fills back() and publishes it;
+// the reader keeps a stable front() until it asks for the newest published value.
+// Neither side ever waits for the other, and a published value is never written again
+// until the reader has moved past it.
+template <typename T>
+class TripleBuffer
+{
+public:
+	// Writer side
+	T& back()
+	{
+		return slots[backIndex];
+	}
+
+	void publish()
+	{
+		int previous = middle.exchange(backIndex | FRESH, std::memory_order_acq_rel);
+		backIndex = previous & INDEX;
+	}
+
+	// Reader side: swap in the newest published value, returns false if nothing new
+	bool update()
+	{
+		if ((middle.load(std::memory_order_acquire) & FRESH) == 0)
+			return false;
+		int previous = middle.exchange(frontIndex, std::memory_order_acq_rel);
+		frontIndex = previous & INDEX;
+		return true;
+	}
+
+	const T& front() const
+	{
+		return slots[frontIndex];
+	}
+
+private:
+	enum { INDEX = 3, FRESH = 4 };
+
+	T slots[3];
+	std::atomic<int> middle{ 1 };
+	int backIndex = 0;		// only touched by the writer
+	int frontIndex = 2;		// only touched by the reader
+};
@@ -1,7 +1,27 @@
 #include "Common.h"
+#include "MeshCache.h"
+#include "TextureCache.h"
+#include "ThreadPool.h"
+#include "TextureStreamer.h"
+#include "Headless.h"
+#include "TripleBuffer.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "GLStateCache.h"
+#include "Frustum.h"
+#include "CrowdGrid.h"
+#include "TransformBatch.h"
+#include "JointRotation.h"
+#include "AnimationClip.h"
 #include "GLM/fwd.hpp"
 #include <cstddef>
 #include <type_traits>
+#include <unordered_map>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <limits>
+#include <filesystem>
 
 #define INIT_WIDTH 1600
 #define INIT_HEIGHT 900
@@ -9,10 +29,54 @@
 #define INIT_VIEWPORT_Y 0
 #define INIT_VIEWPORT_WIDTH 1600
 #define INIT_VIEWPORT_HEIGHT 900
+#define ROBOT_PART_COUNT 12
+#define CROWD_MAX_ROBOTS 100000
+#define CROWD_SPACING 4.0f
+#define CROWD_GRID_CELL (8 * CROWD_SPACING)	// culling grid cells hold up to 8x8 robots
+#define MESH_LOD_COUNT 3						// levels of detail of a simplified mesh, full detail first
+#define LOD_HYSTERESIS 0.15f				// fraction past a threshold before a part changes level
+#define CAMERA_UBO_BINDING 0				// uniform block binding of the per-frame Camera block
+#define DRAW_UBO_BINDING 1					// uniform block binding of the per-draw Draw block
+#define SIM_TICK_RATE 60					// simulation steps per second, independent of the render rate
+#define SIM_MAX_FRAME_TIME 0.25				// longest frame the simulation catches up on, in seconds
+#define CLIP_FADE_TIME (10.0f / SIM_TICK_RATE)	// crossfade between animation clips, in seconds
+#define BAKED_CLIP_SAMPLES 64				// poses baked over the length of each clip for the crowd
+#define BAKED_MAX_CLIPS 16					// size of the shader's clip table, defined into vertex.vs.glsl; keeps the poses within 65536 texels
+#define FLOAT_VERTEX_STRIDE (8 * sizeof(float))
+#define PACKED_VERTEX_STRIDE sizeof(PackedVertex)
+#define TEXTURE_ARRAY_SIZE 1024			// every image shares one resolution as a layer of the texture array
+#define TEXTURE_ARRAY_LEVELS 11
+#define TEXTURE_SPARE_LAYERS 2			// free layers runtime skin streaming uploads into
+#define TEXTURE_ARRAY_UNIT 0
+#define TEXTURE_STREAM_UNIT 1
+#define BAKED_POSE_UNIT 2
+#define PLACEHOLDER_TEXTURE_PATH "asset/texture/gray1.png"
+#define ANIMATION_DIR "asset/anim"
 
 using namespace glm;
 using namespace std;
 
+enum VertexLayout
+{
+	VertexLayoutFloat,		// position, texcoord, normal as 32-bit floats: 32 bytes
+	VertexLayoutPacked		// float position, half texcoord, 2_10_10_10 normal: 20 bytes
+};
+
+// Interleaved vertex used by VertexLayoutPacked
+struct PackedVertex
+{
+	float position[3];
+	uint32_t texcoord;		// 2 x half float
+	uint32_t normal;		// GL_INT_2_10_10_10_REV, snorm
+};
+
+enum TextureFormat
+{
+	TextureFormatRGBA8,			// 8-bit linear, mipmapped
+	TextureFormatSRGB8,			// 8-bit sRGB decoded on sampling, mipmapped, sRGB framebuffer
+	TextureFormatCompressed		// BPTC levels from the preprocessed .ctex cache
+};
+
 enum ModelShape
 {
 	Capsule,
@@ -34,28 +98,87 @@ enum ModelTexture
 	TextureRThigh,
 	TextureCalf,
 	TextureHorn,
+	TextureCount
 };
 
+VertexLayout vertexLayout = VertexLayoutPacked;
+TextureFormat textureFormat = TextureFormatRGBA8;
+int loaderThreads = std::max((int)thread::hardware_concurrency(), 1);
+chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+// --headless: render a scripted sequence offscreen, for display-less benchmarking
+bool headless = false;
+int headlessFrames = 600;
+vector<int> headlessDumpFrames;
+string headlessDumpDir = ".";
+
+// --trace[=path]: record Chrome trace events from startup and write them at exit
+bool traceAtExit = false;
+string tracePath = "trace.json";
+
 // Keyboard Pressing record for multiply key input
 bool keyPressing[400] = {0};
 
-// paramerter for walk animation
-bool isStanding = true;
+// Robot controls: where the robot stands and faces, and which clip it plays when idle
 int walkEnabledCount = 0;
-float walkTimerCount = 0;
-
-// paramerter for sakana animation
-float sakanaTimerCount = 0;
+vec3 robotPosition = vec3(0.0f);
+float robotFacing = 0.0f;			// degrees about the vertical axis
 bool sakanaEnabled = false;
-vec3 sakanaShiftVector = vec3(0.0f);
-bool sakanaDone = true;
+
+// Animation clips from ANIMATION_DIR, loaded before the simulation starts
+vector<AnimationClip> animationClips;
+const AnimationClip* walkClip = NULL;
+const AnimationClip* standClip = NULL;
+const AnimationClip* sakanaClip = NULL;
+const AnimationClip* idleClip = NULL;
+float robotShiftReach = 0.0f;		// farthest any clip shifts a non-root joint
+
+// fixed-timestep simulation, on its own thread unless headless
+chrono::steady_clock::time_point simLastTime;
+double simAccumulator = 0.0;
+int64_t simTicks = 0;			// steps run so far
+double fixedFrameTime = 0.0;	// when > 0, every inline frame advances the clock by this much (headless runs)
+thread simThread;
+atomic<bool> simRunning(false);
 
 // gui
 bool myGuiActive = true;
 
+// profiler scopes, in the order the Profiler below names them
+enum ProfilerScope
+{
+	ProfileStreaming,
+	ProfileCamera,
+	ProfileAnimation,
+	ProfileGrid,
+	ProfileRobot,
+	ProfileImGui
+};
+
+Profiler profiler({ "Texture streaming", "setCameraView", "Animation step", "drawGrid", "drawRobot", "ImGui render" });
+GLStateCache glState;		// every per-frame bind in display() goes through this
+
+// crowd rendering: every robot part grouped by shape and drawn instanced
+bool crowdEnabled = false;
+int crowdCount = 1000;
+bool indirectEnabled = true;		// robot pass as one indirect submission instead of a draw per part
+bool bakedCrowd = false;			// crowd robots play baked clips on the GPU instead of copying the robot
+int bakedCrowdClip = 0;				// the clip they play
+bool cullingEnabled = true;			// skip robots and parts outside the view frustum before any GL call
+bool lodEnabled = true;				// draw simplified meshes for parts small on screen
+atomic<bool> batchedTransforms(true);	// compose rig matrices with composeJoints() instead of glm products per part; read by the simulation thread
+
+// Vertex clustering grid per level (level 0 is the source mesh), and the projected diameter in
+// pixels below which a part drops to the next level
+const int lodGridResolution[MESH_LOD_COUNT] = { 0, 6, 3 };
+const float lodPixelSizes[MESH_LOD_COUNT - 1] = { 64.0f, 24.0f };
 
 mat4 view(1.0f);					// V of MVP, viewing matrix
 mat4 projection(1.0f);				// P of MVP, projection matrix
+int viewportHeight = INIT_VIEWPORT_HEIGHT;
+vec3 lodCamera(0.0f);				// camera position, set with view in display()
+float lodPixelScale = 1.0f;			// projected pixels per unit of size over distance
+float renderClock = 0.0f;			// simulated seconds at this frame's pose, set in display()
 
 struct RotateType
 {
@@ -65,45 +188,150 @@ struct RotateType
 	float onY = 0;
 	RotateType() : onX(0), onZ(0), onY(0) {}
 	RotateType(float x, float z, float y) : onX(x), onZ(z), onY(y) {}
+	bool operator==(const RotateType& other) const { return onX == other.onX && onZ == other.onZ && onY == other.onY; }
+};
+
+// Orientation of Euler angles in degrees: onZ turns about the vertical axis, then onY about
+// the depth axis, then onX about the x axis
+quat jointRotation(const RotateType& rotate)
+{
+	return eulerOrientation(rotate.onX, rotate.onZ, rotate.onY);
+}
+
+// What the simulation animates on one robot part
+struct PartPose
+{
+	vec3 shift;
+	quat orientation;
+};
+
+// Snapshot of the simulation after one tick, enough to rebuild every render matrix
+struct RobotPose
+{
+	PartPose parts[ROBOT_PART_COUNT];
+	float cameraRotateZ;
+	float clock;			// simulated seconds, what baked crowd clips play by
 };
 
 RotateType cameraRotate = RotateType();
 
-GLint um4p;
-GLint um4mv;
-GLint tex;
+GLint textures;
+GLint instanced;
+GLint baked;
+GLint bakedTime;
 
 GLuint program;            // shader program id
 
+// Object-space bounds of one mesh
+struct MeshBounds
+{
+	vec3 min = vec3(0.0f);
+	vec3 max = vec3(0.0f);
+	vec4 sphere = vec4(0.0f);	// center, radius
+};
+
 struct Shape
 {
 	GLuint* gridVAO;
 	GLuint* gridVBO;
-	GLuint* robotVAO;            // vertex array object
-	GLuint* robotVBO;            // vertex buffer object
+	GLuint* robotVBO;            // per-mesh upload buffers, deleted once copied into the arena
+	GLuint* robotEBO;
+	GLuint arenaVAO;             // every robot mesh behind one VAO
+	GLuint arenaVBO;             // all meshes' vertices back to back
+	GLuint arenaEBO;             // all meshes' indices back to back, relative to their mesh
+	vector<int> baseVertices;    // first arena vertex of each mesh
+	vector<int> firstIndices;    // first arena index of each mesh
+	GLuint indirectBuffer;       // DrawElementsIndirectCommands of the current robot pass
 
 	int materialId;
 	int gridLenght;
 	vector<int> vertexCounts;
-	GLuint* m_texture;
+	vector<int> indexCounts;
+	vector<MeshBounds> meshBounds;
+	vector<vector<int>> meshLods;  // mesh slots of each ModelShape's levels of detail, finest first
+	GLuint textureArray;         // every image as one layer of a GL_TEXTURE_2D_ARRAY
+	int textureLayerCount;       // decoded images, then TEXTURE_SPARE_LAYERS free layers for streaming
+	int textureLayers[TextureCount]; // layer each ModelTexture samples
+	int placeholderLayer;        // shown while a streamed texture is still uploading
+	size_t textureBytes;         // resident texture memory under the current policy
+	size_t textureFloatBytes;    // what the same images would take as RGBA32F
+	GLuint crowdVBO;             // per-instance model matrix and texture index
+	GLuint bakedVAO;             // arena vertices with the baked crowd's instance attributes
+	GLuint bakedVBO;             // BakedInstances of the current baked crowd pass
+	GLuint bakedPoseBuffer;      // part model matrices of every baked clip sample
+	GLuint bakedPoseTexture;     // GL_TEXTURE_BUFFER view of bakedPoseBuffer
+	GLuint cameraUBO;            // Camera block: view and projection, written once per frame
+	GLuint drawUBO;              // Draw blocks of every draw this frame, streamed
+	GLint drawStride;            // sizeof(DrawBlock) rounded up to the uniform buffer offset alignment
 };
 
 Shape m_shape;
 
+// std140 mirrors of the shader's uniform blocks
+struct CameraBlock
+{
+	mat4 view;
+	mat4 projection;
+};
+
+struct DrawBlock
+{
+	mat4 model;
+	int layer;			// texture array layer
+	int padding[3];
+};
+
+// Layout glDrawElementsIndirect reads from GL_DRAW_INDIRECT_BUFFER
+struct DrawElementsIndirectCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+// glMultiDrawElementsIndirect is core in 4.3 but the bundled glad stops at 4.2, so it is
+// looked up at runtime; NULL without GL 4.3 or ARB_multi_draw_indirect
+typedef void (APIENTRYP PFNMULTIDRAWELEMENTSINDIRECTPROC)(GLenum mode, GLenum type, const void* indirect, GLsizei drawcount, GLsizei stride);
+PFNMULTIDRAWELEMENTSINDIRECTPROC multiDrawElementsIndirect = NULL;
+// Draws that start past instance 0, directly or through an indirect command's baseInstance,
+// need GL 4.2 or ARB_base_instance; NULL without either
+PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXBASEINSTANCEPROC drawElementsBaseInstance = NULL;
+GLADloadproc glProcAddress = NULL;	// the loader glad was initialized with
+
+struct CrowdInstance
+{
+	mat4 model;
+	int texture;
+};
+
+// Instance of a robot part posed by the vertex shader from the baked clips
+struct BakedInstance
+{
+	vec4 placement;		// robot position, then its phase offset in cycles of the clip
+	int texture;
+	int part;
+	int clip;
+};
+
 struct TextureData
 {
 	int width;
 	int height;
 	unsigned char* data;
+	vector<vector<unsigned char>> levels;	// RGBA8 mip chain built on the loader thread
+	MappedFile cache;	// preprocessed levels, when the compressed policy found a valid cache
 
 	TextureData() : width(0), height(0), data(0) {}
 };
 
+// stbi_set_flip_vertically_on_load() is process-wide in this stb version,
+// so it is set once before any loader thread starts decoding
 TextureData loadImg(const char* path)
 {
 	TextureData texture;
 	int n;
-	stbi_set_flip_vertically_on_load(true);
 	stbi_uc *data = stbi_load(path, &texture.width, &texture.height, &n, 4);
 	if(data != NULL)
 	{
@@ -116,26 +344,103 @@ TextureData loadImg(const char* path)
 
 struct ObjectData
 {
-	vector<float> vertices;
-	vector<float> texcoords;
-	vector<float> normals;
+	MappedFile cache;               // mapped mesh cache, empty when the mesh was parsed from .obj
+	vector<unsigned char> vertices; // unique interleaved vertices in vertexLayout when parsed
+	vector<uint32_t> indices;       // triangle list into vertices when parsed
+	int vertexCount = 0;
+	int indexCount = 0;
+	int vertexStride = 0;
+	MeshBounds bounds;
+
+	const void* vertexData() const
+	{
+		return cache.data != nullptr ? cache.data + sizeof(MeshCacheHeader) : (const void*)vertices.data();
+	}
+
+	const void* indexData() const
+	{
+		return cache.data != nullptr ? cache.data + sizeof(MeshCacheHeader) + vertexBytes() : (const void*)indices.data();
+	}
 
-	ObjectData(vector<float> vect, vector<float> texc, vector<float> norm) : 
-		vertices(vect), texcoords(texc), normals(norm) {}
+	size_t vertexBytes() const
+	{
+		return (size_t)vertexCount * vertexStride;
+	}
 
-	~ObjectData()
+	size_t indexBytes() const
 	{
-		vertices.clear();
-		vertices.shrink_to_fit();
-		texcoords.clear();
-		texcoords.shrink_to_fit();
-		normals.clear();
-		normals.shrink_to_fit();
+		return (size_t)indexCount * sizeof(uint32_t);
 	}
 };
 
+int vertexLayoutStride(VertexLayout layout)
+{
+	return (int)(layout == VertexLayoutPacked ? PACKED_VERTEX_STRIDE : FLOAT_VERTEX_STRIDE);
+}
+
+// Convert interleaved float vertices (position 3, texcoord 2, normal 3) into the given layout
+vector<unsigned char> packVertices(const vector<float>& source, VertexLayout layout)
+{
+	if (layout == VertexLayoutFloat)
+		return vector<unsigned char>((const unsigned char*)source.data(), (const unsigned char*)(source.data() + source.size()));
+
+	size_t vertexCount = source.size() / 8;
+	vector<unsigned char> packed(vertexCount * sizeof(PackedVertex));
+	PackedVertex* out = (PackedVertex*)packed.data();
+	for (size_t i = 0; i < vertexCount; ++i)
+	{
+		const float* in = &source[i * 8];
+		out[i].position[0] = in[0];
+		out[i].position[1] = in[1];
+		out[i].position[2] = in[2];
+		out[i].texcoord = packHalf2x16(vec2(in[3], in[4]));
+		out[i].normal = packSnorm3x10_1x2(vec4(in[5], in[6], in[7], 0.0f));
+	}
+	return packed;
+}
+
+// Describe the interleaved attributes 0-2 of the currently bound VBO
+void setVertexAttributes(VertexLayout layout)
+{
+	if (layout == VertexLayoutPacked)
+	{
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, PACKED_VERTEX_STRIDE, (GLvoid*)offsetof(PackedVertex, position));
+		glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, PACKED_VERTEX_STRIDE, (GLvoid*)offsetof(PackedVertex, texcoord));
+		glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, PACKED_VERTEX_STRIDE, (GLvoid*)offsetof(PackedVertex, normal));
+	}
+	else
+	{
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, FLOAT_VERTEX_STRIDE, 0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, FLOAT_VERTEX_STRIDE, (GLvoid*)(3 * sizeof(float)));
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, FLOAT_VERTEX_STRIDE, (GLvoid*)(5 * sizeof(float)));
+	}
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+}
+
+// OBJ corners referencing the same position/texcoord/normal triple share one vertex
+struct VertexKey
+{
+	int vertex;
+	int texcoord;
+	int normal;
+
+	bool operator==(const VertexKey& other) const 
+	{ 
+		return vertex == other.vertex && texcoord == other.texcoord && normal == other.normal; 
+	}
+};
+
+struct VertexKeyHash
+{
+	size_t operator()(const VertexKey& key) const
+	{
+		return ((size_t)key.vertex * 73856093u) ^ ((size_t)key.texcoord * 19349663u) ^ ((size_t)key.normal * 83492791u);
+	}
+};
 
-ObjectData loadObjectData(char* filename)
+ObjectData parseObjectData(const char* filename)
 {
 	tinyobj::attrib_t attrib;
 	vector<tinyobj::shape_t> shapes;
@@ -153,35 +458,178 @@ ObjectData loadObjectData(char* filename)
 		exit(1);
 	}
 	
-	vector<float> vertices, texcoords, normals; // if OBJ preserves vertex order, you can use element array buffer for memory efficiency
-	int vertexCount = 0;                        // for 'ladybug.obj', there is only one object
+	ObjectData object;
+	vector<float> vertices;
+	size_t cornerCount = 0;
+	for (size_t s = 0; s < shapes.size(); ++s)
+		cornerCount += shapes[s].mesh.indices.size();
+	object.indices.reserve(cornerCount);
+
+	unordered_map<VertexKey, uint32_t, VertexKeyHash> welded;
+	welded.reserve(cornerCount);
 	for (int s = 0; s < shapes.size(); ++s) {  
 		int index_offset = 0;
 		for (int f = 0; f < shapes[s].mesh.num_face_vertices.size(); ++f) {
 			int fv = shapes[s].mesh.num_face_vertices[f];
 			for (int v = 0; v < fv; ++v) {
 				tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-				vertices.push_back(attrib.vertices[3 * idx.vertex_index + 0]);
-				vertices.push_back(attrib.vertices[3 * idx.vertex_index + 1]);
-				vertices.push_back(attrib.vertices[3 * idx.vertex_index + 2]);
-				texcoords.push_back(attrib.texcoords[2 * idx.texcoord_index + 0]);
-				texcoords.push_back(attrib.texcoords[2 * idx.texcoord_index + 1]);
-				normals.push_back(attrib.normals[3 * idx.normal_index + 0]);
-				normals.push_back(attrib.normals[3 * idx.normal_index + 1]);
-				normals.push_back(attrib.normals[3 * idx.normal_index + 2]);
+				auto inserted = welded.insert({ VertexKey{ idx.vertex_index, idx.texcoord_index, idx.normal_index }, (uint32_t)object.vertexCount });
+				if (inserted.second)
+				{
+					vertices.insert(vertices.end(), {
+						attrib.vertices[3 * idx.vertex_index + 0],
+						attrib.vertices[3 * idx.vertex_index + 1],
+						attrib.vertices[3 * idx.vertex_index + 2],
+						attrib.texcoords[2 * idx.texcoord_index + 0],
+						attrib.texcoords[2 * idx.texcoord_index + 1],
+						attrib.normals[3 * idx.normal_index + 0],
+						attrib.normals[3 * idx.normal_index + 1],
+						attrib.normals[3 * idx.normal_index + 2]
+					});
+					object.vertexCount++;
+				}
+				object.indices.push_back(inserted.first->second);
 			}
 			index_offset += fv;
-			vertexCount += fv;
 		}
 	}
+	object.indexCount = object.indices.size();
+	object.vertexStride = vertexLayoutStride(vertexLayout);
+	object.vertices = packVertices(vertices, vertexLayout);
 
-	m_shape.vertexCounts.push_back(vertexCount);
-	shapes.clear();
-	shapes.shrink_to_fit();
-	materials.clear();
-	materials.shrink_to_fit();
+	return object;
+}
 
-	return ObjectData(vertices, texcoords, normals);
+// AABB of the vertices, and a sphere around the AABB center through the farthest vertex
+MeshBounds computeBounds(const ObjectData& object)
+{
+	MeshBounds bounds;
+	if (object.vertexCount == 0)
+		return bounds;
+	// Every vertex layout starts with the position as three floats
+	const unsigned char* vertices = (const unsigned char*)object.vertexData();
+	auto position = [&](int i) { return make_vec3((const float*)(vertices + (size_t)i * object.vertexStride)); };
+	bounds.min = bounds.max = position(0);
+	for (int i = 1; i < object.vertexCount; ++i)
+	{
+		bounds.min = glm::min(bounds.min, position(i));
+		bounds.max = glm::max(bounds.max, position(i));
+	}
+	vec3 center = 0.5f * (bounds.min + bounds.max);
+	float radius = 0.0f;
+	for (int i = 0; i < object.vertexCount; ++i)
+		radius = std::max(radius, distance(center, position(i)));
+	bounds.sphere = vec4(center, radius);
+	return bounds;
+}
+
+// Load a mesh from its binary cache, rebuilding the cache from the .obj when missing or stale
+ObjectData loadObjectData(const char* filename)
+{
+	ObjectData object;
+	if (openMeshCache(filename, object.cache))
+	{
+		const MeshCacheHeader* header = (const MeshCacheHeader*)object.cache.data;
+		if (header->vertexLayout == vertexLayout && header->vertexStride == (uint32_t)vertexLayoutStride(vertexLayout))
+		{
+			object.vertexCount = header->vertexCount;
+			object.indexCount = header->indexCount;
+			object.vertexStride = header->vertexStride;
+			object.bounds = computeBounds(object);
+			return object;
+		}
+		object.cache.close();
+	}
+
+	object = parseObjectData(filename);
+	object.bounds = computeBounds(object);
+	if (!writeMeshCache(filename, vertexLayout, object.vertices.data(), object.vertexCount, object.vertexStride, object.indices.data(), object.indexCount))
+		cout << "Failed to write mesh cache for " << filename << endl;
+	return object;
+}
+
+// Vertex clustering: vertices snap to a resolution^3 grid over the mesh's AABB, each cell keeps
+// the source vertex nearest the average of its members, and triangles that collapse are dropped.
+// Kept vertices are copied whole, so this works on any vertex layout.
+ObjectData simplifyObject(const ObjectData& source, int resolution)
+{
+	const unsigned char* vertices = (const unsigned char*)source.vertexData();
+	const uint32_t* indices = (const uint32_t*)source.indexData();
+	auto position = [&](int i) { return make_vec3((const float*)(vertices + (size_t)i * source.vertexStride)); };
+
+	vec3 low = source.bounds.min;
+	vec3 cellSize = glm::max(source.bounds.max - low, vec3(1e-6f)) / (float)resolution;
+	unordered_map<int, int> clusterOfCell;
+	vector<int> clusterOf(source.vertexCount);
+	vector<vec3> sums;
+	vector<int> counts;
+	for (int i = 0; i < source.vertexCount; ++i)
+	{
+		ivec3 cell = clamp(ivec3((position(i) - low) / cellSize), ivec3(0), ivec3(resolution - 1));
+		auto inserted = clusterOfCell.insert({ (cell.x * resolution + cell.y) * resolution + cell.z, (int)sums.size() });
+		if (inserted.second)
+		{
+			sums.push_back(vec3(0.0f));
+			counts.push_back(0);
+		}
+		clusterOf[i] = inserted.first->second;
+		sums[clusterOf[i]] += position(i);
+		counts[clusterOf[i]]++;
+	}
+
+	vector<int> representative(sums.size(), -1);
+	vector<float> nearest(sums.size(), numeric_limits<float>::max());
+	for (int i = 0; i < source.vertexCount; ++i)
+	{
+		int cluster = clusterOf[i];
+		float d = distance(position(i), sums[cluster] / (float)counts[cluster]);
+		if (d < nearest[cluster])
+		{
+			nearest[cluster] = d;
+			representative[cluster] = i;
+		}
+	}
+
+	ObjectData object;
+	object.vertexStride = source.vertexStride;
+	object.vertexCount = representative.size();
+	object.vertices.resize((size_t)object.vertexCount * object.vertexStride);
+	for (int cluster = 0; cluster < object.vertexCount; ++cluster)
+		memcpy(&object.vertices[(size_t)cluster * object.vertexStride], vertices + (size_t)representative[cluster] * source.vertexStride, object.vertexStride);
+	for (int i = 0; i + 2 < source.indexCount; i += 3)
+	{
+		uint32_t a = clusterOf[indices[i]], b = clusterOf[indices[i + 1]], c = clusterOf[indices[i + 2]];
+		if (a != b && b != c && a != c)
+			object.indices.insert(object.indices.end(), { a, b, c });
+	}
+	object.indexCount = object.indices.size();
+	object.bounds = computeBounds(object);
+	return object;
+}
+
+// Level lod of a mesh from its cache file, simplifying source and writing the cache when missing or stale
+ObjectData loadObjectLod(const char* filename, const ObjectData& source, int lod)
+{
+	ObjectData object;
+	if (openMeshCache(filename, object.cache, lod))
+	{
+		const MeshCacheHeader* header = (const MeshCacheHeader*)object.cache.data;
+		if (header->vertexLayout == vertexLayout && header->vertexStride == (uint32_t)vertexLayoutStride(vertexLayout) && 
+			header->lodGrid == (uint32_t)lodGridResolution[lod])
+		{
+			object.vertexCount = header->vertexCount;
+			object.indexCount = header->indexCount;
+			object.vertexStride = header->vertexStride;
+			object.bounds = computeBounds(object);
+			return object;
+		}
+		object.cache.close();
+	}
+
+	object = simplifyObject(source, lodGridResolution[lod]);
+	if (!writeMeshCache(filename, vertexLayout, object.vertices.data(), object.vertexCount, object.vertexStride, object.indices.data(), object.indexCount, lod, lodGridResolution[lod]))
+		cout << "Failed to write mesh cache for " << filename << " LOD " << lod << endl;
+	return object;
 }
 
 // Load shader file to program
@@ -199,6 +647,19 @@ char** loadShaderSource(const char* file)
 	return srcp;
 }
 
+// Insert "#define name value" after the #version line; #line keeps compile errors on the file's own line numbers
+void defineShaderConstant(char** srcp, const char* name, int value)
+{
+	const char* src = srcp[0];
+	const char* body = strchr(src, '\n');
+	body = body != NULL ? body + 1 : src + strlen(src);
+	string combined = string(src, body) + "#define " + name + " " + to_string(value) + "\n#line 2\n" + body;
+	char* dst = new char[combined.size() + 1];
+	memcpy(dst, combined.c_str(), combined.size() + 1);
+	delete[] srcp[0];
+	srcp[0] = dst;
+}
+
 // Free shader file
 void freeShaderSource(char** srcp)
 {
@@ -252,89 +713,529 @@ void loadGrid(int slices, float size)
 	m_shape.gridLenght = (GLuint)indices.size()*4;
 }
 
+// Files are decoded on worker threads; each finished decode queues a GL upload
+// that only ever runs on the context thread, in finish()
+struct AssetLoader
+{
+	CompletionQueue<function<void()>> uploads;
+	int pending = 0;
+	ThreadPool pool;	// declared last so it stops before the queue it feeds is destroyed
+
+	explicit AssetLoader(int threads) : pool(threads) {}
+
+	// decode runs on a worker and returns the upload to run on the context thread
+	void submit(function<function<void()>()> decode)
+	{
+		pending++;
+		pool.submit([this, decode] {
+			tracer.nameThread("Loader");
+			uploads.push(decode());
+		});
+	}
+
+	void finish()
+	{
+		for (; pending > 0; --pending)
+			uploads.pop()();
+	}
+};
+
+const char* modelPaths[] = {
+	"asset/model/Capsule.obj",
+	"asset/model/Cone.obj",
+	"asset/model/Cube.obj",
+	"asset/model/Cylinder.obj",
+	"asset/model/Plane.obj",
+	"asset/model/Sphere.obj"
+};
+
+// Meshes dense enough to be worth simplified levels of detail
+const bool modelHasLods[] = { true, false, false, false, false, true };
+
+// i is a mesh slot, see Shape::meshLods
+void uploadModel(int i, const ObjectData& object, const string& name)
+{
+	m_shape.vertexCounts[i] = object.vertexCount;
+	m_shape.indexCounts[i] = object.indexCount;
+	m_shape.meshBounds[i] = object.bounds;
+
+	// Interleaved vertices and indices go to the GPU straight from the mapped cache,
+	// loadArena() moves them into place once every size is known
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_shape.robotVBO[i]);
+	glBufferData(GL_COPY_WRITE_BUFFER, object.vertexBytes(), object.vertexData(), GL_STATIC_COPY);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_shape.robotEBO[i]);
+	glBufferData(GL_COPY_WRITE_BUFFER, object.indexBytes(), object.indexData(), GL_STATIC_COPY);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	cout << "Load " << name << ": " << object.vertexCount << " vertices, " << object.indexCount << " indices" << (object.cache.data != nullptr ? " (cached)" : "") << endl;
+}
+
 // Load .obj model
-void loadModels()
-{
-	vector<ObjectData> objects;
-	objects.push_back(loadObjectData((char*)("asset/model/Capsule.obj")));
-	objects.push_back(loadObjectData((char*)("asset/model/Cone.obj")));
-	objects.push_back(loadObjectData((char*)("asset/model/Cube.obj")));
-	objects.push_back(loadObjectData((char*)("asset/model/Cylinder.obj")));
-	objects.push_back(loadObjectData((char*)("asset/model/Plane.obj")));
-	objects.push_back(loadObjectData((char*)("asset/model/Sphere.obj")));
-
-	int objectsCount = objects.size();
-	m_shape.robotVAO = new GLuint[objectsCount + 1];
-	m_shape.robotVBO = new GLuint[objectsCount + 1];
-	
-	// Generate and bind VAO
-	glGenVertexArrays(objectsCount, m_shape.robotVAO);
-	glBindVertexArray(m_shape.robotVAO[0]);
+void loadModels(AssetLoader& loader)
+{
+	int objectsCount = sizeof(modelPaths) / sizeof(modelPaths[0]);
+
+	// Slot i is ModelShape i at full detail; simplified levels take the slots after those
+	m_shape.meshLods.assign(objectsCount, vector<int>());
+	int slotCount = objectsCount;
+	for (int i = 0; i < objectsCount; ++i)
+	{
+		m_shape.meshLods[i].push_back(i);
+		for (int lod = 1; modelHasLods[i] && lod < MESH_LOD_COUNT; ++lod)
+			m_shape.meshLods[i].push_back(slotCount++);
+	}
+	m_shape.robotVBO = new GLuint[slotCount + 1];
+	m_shape.robotEBO = new GLuint[slotCount + 1];
+	m_shape.vertexCounts.assign(slotCount, 0);
+	m_shape.indexCounts.assign(slotCount, 0);
+	m_shape.meshBounds.assign(slotCount, MeshBounds());
 	
 	// Generate VBO
-	glGenBuffers(objectsCount, m_shape.robotVBO);
+	glGenBuffers(slotCount, m_shape.robotVBO);
+	glGenBuffers(slotCount, m_shape.robotEBO);
 
-	// Bind VBO[0]
-	size_t offsSize = 0;
 	for (int i = 0; i < objectsCount; ++i)
 	{
-		size_t vectSize = objects[i].vertices.size() * sizeof(float);
-		size_t texcSize = objects[i].texcoords.size() * sizeof(float);
-		size_t normSize = objects[i].normals.size() * sizeof(float);
-		glBindVertexArray(m_shape.robotVAO[i]);
-		glBindBuffer(GL_ARRAY_BUFFER, m_shape.robotVBO[i]);
-		glBufferData(GL_ARRAY_BUFFER, vectSize + texcSize + normSize, NULL, GL_STATIC_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, vectSize, objects[i].vertices.data());
-		glBufferSubData(GL_ARRAY_BUFFER, vectSize, texcSize, objects[i].texcoords.data());
-		glBufferSubData(GL_ARRAY_BUFFER, vectSize + texcSize, normSize, objects[i].normals.data());
-		
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid*)vectSize);
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)(vectSize + texcSize));
-		glEnableVertexAttribArray(2);
-		
-		glBindVertexArray(0);
-		offsSize += vectSize + texcSize + normSize;
-		cout << "Load " << m_shape.vertexCounts[i] << " vertices" << endl;
-	}
-}
-
-void loadTextures()
-{
-	vector<TextureData> textures;
-	textures.push_back(loadImg("asset/texture/Kuro.png"));
-	textures.push_back(loadImg("asset/texture/TakinaHead.png"));
-	textures.push_back(loadImg("asset/texture/TakinaTorso.png"));
-	textures.push_back(loadImg("asset/texture/TakinaUpperarm.png"));
-	textures.push_back(loadImg("asset/texture/TakinaSkin.png"));
-	textures.push_back(loadImg("asset/texture/TakinaLeftThigh.png"));
-	textures.push_back(loadImg("asset/texture/TakinaRightThigh.png"));
-	textures.push_back(loadImg("asset/texture/TakinaSkin.png"));
-	textures.push_back(loadImg("asset/texture/TakinaCatear.png"));	
-
-	int texturesCount = textures.size();
-
-	m_shape.m_texture = new GLuint[texturesCount + 1];
-	glGenTextures(texturesCount, m_shape.m_texture);
+		loader.submit([i] {
+			TraceScope trace("Decode model");
+			vector<shared_ptr<ObjectData>> levels;
+			levels.push_back(make_shared<ObjectData>(loadObjectData(modelPaths[i])));
+			for (size_t lod = 1; lod < m_shape.meshLods[i].size(); ++lod)
+				levels.push_back(make_shared<ObjectData>(loadObjectLod(modelPaths[i], *levels[0], lod)));
+			return function<void()>([i, levels] {
+				TraceScope trace("Upload model");
+				for (size_t lod = 0; lod < levels.size(); ++lod)
+					uploadModel(m_shape.meshLods[i][lod], *levels[lod], lod == 0 ? string(modelPaths[i]) : string(modelPaths[i]) + " LOD " + to_string(lod));
+			});
+		});
+	}
+}
 
+// Pack every robot mesh into one vertex and one index buffer behind a single VAO,
+// copying on the GPU from the per-mesh buffers the loader filled
+void loadArena()
+{
+	int objectsCount = m_shape.vertexCounts.size();
+	int stride = vertexLayoutStride(vertexLayout);
+	m_shape.baseVertices.assign(objectsCount, 0);
+	m_shape.firstIndices.assign(objectsCount, 0);
+	size_t vertexTotal = 0, indexTotal = 0;
+	for (int i = 0; i < objectsCount; ++i)
+	{
+		m_shape.baseVertices[i] = vertexTotal;
+		m_shape.firstIndices[i] = indexTotal;
+		vertexTotal += m_shape.vertexCounts[i];
+		indexTotal += m_shape.indexCounts[i];
+	}
+
+	glGenVertexArrays(1, &m_shape.arenaVAO);
+	glBindVertexArray(m_shape.arenaVAO);
+	glGenBuffers(1, &m_shape.arenaVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.arenaVBO);
+	glBufferData(GL_ARRAY_BUFFER, vertexTotal * stride, NULL, GL_STATIC_DRAW);
+	glGenBuffers(1, &m_shape.arenaEBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_shape.arenaEBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexTotal * sizeof(uint32_t), NULL, GL_STATIC_DRAW);
+	for (int i = 0; i < objectsCount; ++i)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, m_shape.robotVBO[i]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0, (GLintptr)m_shape.baseVertices[i] * stride, (GLsizeiptr)m_shape.vertexCounts[i] * stride);
+		glBindBuffer(GL_COPY_READ_BUFFER, m_shape.robotEBO[i]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ELEMENT_ARRAY_BUFFER, 0, (GLintptr)m_shape.firstIndices[i] * sizeof(uint32_t), (GLsizeiptr)m_shape.indexCounts[i] * sizeof(uint32_t));
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	setVertexAttributes(vertexLayout);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glDeleteBuffers(objectsCount, m_shape.robotVBO);
+	glDeleteBuffers(objectsCount, m_shape.robotEBO);
+	glGenBuffers(1, &m_shape.indirectBuffer);
+	printf("Mesh arena: %zu vertices, %zu indices\n", vertexTotal, indexTotal);
+}
+
+// Whether the context is GL major.minor or later, or lists extension
+bool glSupports(int major, int minor, const char* extension)
+{
+	GLint contextMajor = 0, contextMinor = 0, extensionCount = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &contextMajor);
+	glGetIntegerv(GL_MINOR_VERSION, &contextMinor);
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+	bool supported = contextMajor > major || (contextMajor == major && contextMinor >= minor);
+	for (int i = 0; i < extensionCount && !supported; ++i)
+		supported = strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), extension) == 0;
+	return supported;
+}
+
+void loadMultiDrawIndirect()
+{
+	if (glSupports(4, 2, "GL_ARB_base_instance") && glProcAddress != NULL)
+		drawElementsBaseInstance = (PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXBASEINSTANCEPROC)glProcAddress("glDrawElementsInstancedBaseVertexBaseInstance");
+	if (drawElementsBaseInstance != NULL && glSupports(4, 3, "GL_ARB_multi_draw_indirect"))
+		multiDrawElementsIndirect = (PFNMULTIDRAWELEMENTSINDIRECTPROC)glProcAddress("glMultiDrawElementsIndirect");
+	printf("Indirect submission: %s\n", multiDrawElementsIndirect != NULL ? "glMultiDrawElementsIndirect" : 
+		drawElementsBaseInstance != NULL ? "one glDrawElementsIndirect per command" : "none, one instanced draw per command without base instances");
+}
+
+// Vertex bytes fetched by one full draw of each mesh, float layout vs the active layout
+void reportModels()
+{
+	size_t floatTotal = 0, activeTotal = 0;
+	for (size_t i = 0; i < m_shape.meshLods.size(); ++i)
+	{
+		size_t floatBytes = (size_t)m_shape.vertexCounts[i] * FLOAT_VERTEX_STRIDE;
+		size_t activeBytes = (size_t)m_shape.vertexCounts[i] * vertexLayoutStride(vertexLayout);
+		floatTotal += floatBytes;
+		activeTotal += activeBytes;
+		printf("%-28s %6zu -> %6zu bytes\n", modelPaths[i], floatBytes, activeBytes);
+	}
+	printf("Vertex data: %zu -> %zu bytes (%d -> %d bytes/vertex)\n", floatTotal, activeTotal, (int)FLOAT_VERTEX_STRIDE, vertexLayoutStride(vertexLayout));
+}
+
+GLenum textureInternalFormat(TextureFormat format)
+{
+	switch (format)
+	{
+		case TextureFormatSRGB8:
+			return GL_SRGB8_ALPHA8;
+		case TextureFormatCompressed:
+			return GL_COMPRESSED_RGBA_BPTC_UNORM;
+		default:
+			return GL_RGBA8;
+	}
+}
+
+// Size in bytes of one layer of one array level under the texture format policy
+size_t textureLevelBytes(int width, int height)
+{
+	if (textureFormat == TextureFormatCompressed)
+		return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 16;	// BPTC stores 16 bytes per 4x4 block
+	return (size_t)width * height * 4;
+}
+
+// Let the driver encode each box-filtered level once through a scratch 2D texture and read its output back
+vector<vector<unsigned char>> compressLevels(const vector<vector<unsigned char>>& levels, int width, int height)
+{
+	GLenum internalFormat = textureInternalFormat(TextureFormatCompressed);
+	GLuint scratch;
+	glGenTextures(1, &scratch);
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_STREAM_UNIT);
+	glBindTexture(GL_TEXTURE_2D, scratch);
+
+	vector<vector<unsigned char>> compressed(levels.size());
+	for (size_t level = 0; level < levels.size(); ++level)
+	{
+		glTexImage2D(GL_TEXTURE_2D, level, internalFormat, std::max(width >> level, 1), std::max(height >> level, 1), 0, GL_RGBA, GL_UNSIGNED_BYTE, levels[level].data());
+		GLint size = 0;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+		compressed[level].resize(size);
+		glGetCompressedTexImage(GL_TEXTURE_2D, level, compressed[level].data());
+	}
+	glDeleteTextures(1, &scratch);
+	return compressed;
+}
+
+// Upload every level of a decoded image into one layer of the texture array.
+// Compressed levels come from the image's cache, which is built here the first time.
+void uploadTextureLayer(const char* path, const TextureData& texture, int layer)
+{
+	vector<vector<unsigned char>> compressed;
+	GLenum internalFormat = textureInternalFormat(TextureFormatCompressed);
+	if (textureFormat == TextureFormatCompressed && texture.cache.data == nullptr)
+	{
+		compressed = compressLevels(texture.levels, texture.width, texture.height);
+		if (!writeTextureCache(path, internalFormat, texture.width, texture.height, compressed))
+			cout << "Failed to write texture cache for " << path << endl;
+	}
+
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_ARRAY_UNIT);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_shape.textureArray);
+	for (int level = 0; level < TEXTURE_ARRAY_LEVELS; ++level)
+	{
+		int size = std::max(TEXTURE_ARRAY_SIZE >> level, 1);
+		if (textureFormat != TextureFormatCompressed)
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, texture.levels[level].data());
+		else if (!compressed.empty())
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, size, size, 1, internalFormat, compressed[level].size(), compressed[level].data());
+		else
+		{
+			const TextureCacheHeader* header = (const TextureCacheHeader*)texture.cache.data;
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, size, size, 1, internalFormat, header->levelSizes[level], textureCacheLevel(texture.cache, level));
+		}
+	}
+}
+
+// Decode on a loader thread, mip chain included. A valid compressed cache skips PNG decoding entirely.
+TextureData decodeTexture(const char* path)
+{
+	if (textureFormat == TextureFormatCompressed)
+	{
+		TextureData texture;
+		if (openTextureCache(path, textureInternalFormat(TextureFormatCompressed), texture.cache))
+		{
+			const TextureCacheHeader* header = (const TextureCacheHeader*)texture.cache.data;
+			texture.width = header->width;
+			texture.height = header->height;
+			return texture;
+		}
+	}
+
+	TextureData texture = loadImg(path);
+	if (texture.data != NULL)
+	{
+		texture.levels = buildMipChain(texture.data, texture.width, texture.height);
+		delete[] texture.data;
+		texture.data = NULL;
+	}
+	return texture;
+}
+
+void loadTextures(AssetLoader& loader)
+{
+	// BPTC is core only from GL 4.2, so a 4.1 context without the extension decodes to plain RGBA8 instead
+	if (textureFormat == TextureFormatCompressed && !glSupports(4, 2, "GL_ARB_texture_compression_bptc"))
+	{
+		printf("BPTC texture compression unsupported, loading textures as RGBA8\n");
+		textureFormat = TextureFormatRGBA8;
+	}
+	const char* paths[] = {
+		"asset/texture/Kuro.png",
+		"asset/texture/TakinaHead.png",
+		"asset/texture/TakinaTorso.png",
+		"asset/texture/TakinaUpperarm.png",
+		"asset/texture/TakinaSkin.png",
+		"asset/texture/TakinaLeftThigh.png",
+		"asset/texture/TakinaRightThigh.png",
+		"asset/texture/TakinaSkin.png",
+		"asset/texture/TakinaCatear.png"
+	};
+	int texturesCount = sizeof(paths) / sizeof(paths[0]);
+
+	// Each distinct file is decoded and uploaded once into its own layer, which every unit using it samples.
+	// The placeholder is one more layer that no part samples until a stream starts.
+	map<string, vector<int>> units;
 	for (int i = 0; i < texturesCount; ++i)
+		units[paths[i]].push_back(i);
+	units[PLACEHOLDER_TEXTURE_PATH];
+
+	m_shape.textureLayerCount = units.size() + TEXTURE_SPARE_LAYERS;
+	glGenTextures(1, &m_shape.textureArray);
+	glActiveTexture(GL_TEXTURE0 + TEXTURE_ARRAY_UNIT);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_shape.textureArray);
+	// Immutable storage is GL 4.2 or ARB_texture_storage, which a 4.1 context may lack;
+	// there every level is specified on its own
+	GLenum internalFormat = textureInternalFormat(textureFormat);
+	PFNGLTEXSTORAGE3DPROC texStorage3D = NULL;
+	if (glSupports(4, 2, "GL_ARB_texture_storage") && glProcAddress != NULL)
+		texStorage3D = (PFNGLTEXSTORAGE3DPROC)glProcAddress("glTexStorage3D");
+	if (texStorage3D != NULL)
+		texStorage3D(GL_TEXTURE_2D_ARRAY, TEXTURE_ARRAY_LEVELS, internalFormat, TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE, m_shape.textureLayerCount);
+	else
+		for (int level = 0; level < TEXTURE_ARRAY_LEVELS; ++level)
+		{
+			int size = std::max(TEXTURE_ARRAY_SIZE >> level, 1);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat, size, size, m_shape.textureLayerCount, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, TEXTURE_ARRAY_LEVELS - 1);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	m_shape.textureBytes = 0;
+	m_shape.textureFloatBytes = 0;
+	for (int level = 0; level < TEXTURE_ARRAY_LEVELS; ++level)
+	{
+		int size = std::max(TEXTURE_ARRAY_SIZE >> level, 1);
+		m_shape.textureBytes += textureLevelBytes(size, size) * m_shape.textureLayerCount;
+	}
+
+	int layer = 0;
+	for (auto& entry : units)
 	{
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(GL_TEXTURE_2D, m_shape.m_texture[i]);
-		
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, textures[i].width, textures[i].height, 0, GL_RGBA, GL_UNSIGNED_BYTE, textures[i].data);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		string path = entry.first;
+		vector<int> slots = entry.second;
+		for (int slot : slots)
+			m_shape.textureLayers[slot] = layer;
+		if (path == PLACEHOLDER_TEXTURE_PATH)
+			m_shape.placeholderLayer = layer;
+
+		loader.submit([path, slots, layer] {
+			TraceScope trace("Decode texture");
+			shared_ptr<TextureData> texture = make_shared<TextureData>(decodeTexture(path.c_str()));
+			return function<void()>([path, slots, layer, texture] {
+				TraceScope trace("Upload texture");
+				if (texture->width != TEXTURE_ARRAY_SIZE || texture->height != TEXTURE_ARRAY_SIZE)
+				{
+					cout << "Texture " << path << " is not " << TEXTURE_ARRAY_SIZE << "x" << TEXTURE_ARRAY_SIZE << ", layer " << layer << " left empty" << endl;
+					return;
+				}
+				uploadTextureLayer(path.c_str(), *texture, layer);
+				// Compare against what the old policy kept resident: RGBA32F, single level, one copy per unit
+				m_shape.textureFloatBytes += (size_t)texture->width * texture->height * 4 * sizeof(float) * slots.size();
+			});
+		});
+		layer++;
 	}
 }
 
+// Character skins that can be streamed onto the torso at runtime
+const char* skinPaths[] = {
+	"asset/texture/TakinaTorso.png",
+	"asset/texture/Airi.png",
+	"asset/texture/Ena.png",
+	"asset/texture/Hai.png",
+	"asset/texture/Haruka.png",
+	"asset/texture/Honami.png",
+	"asset/texture/Ichika.png",
+	"asset/texture/Kanade.png",
+	"asset/texture/Mafuyu.png",
+	"asset/texture/Minori.png",
+	"asset/texture/Mizuki.png",
+	"asset/texture/Niigo.png",
+	"asset/texture/Saki.png",
+	"asset/texture/Shiho.png",
+	"asset/texture/Shiro.png",
+	"asset/texture/Shizuku.png"
+};
+
+TextureStreamer textureStreamer;
+
+// The layer a unit samples changed: to the placeholder when a stream starts, then to the
+// streamed layer. A layer nothing samples any more goes back to the streamer as a spare.
+void textureStreamed(int unit, int layer)
+{
+	int previous = m_shape.textureLayers[unit];
+	m_shape.textureLayers[unit] = layer;
+
+	bool shared = previous == m_shape.placeholderLayer;
+	for (int i = 0; i < TextureCount; ++i)
+		shared = shared || m_shape.textureLayers[i] == previous;
+	if (!shared)
+		textureStreamer.release(previous);
+}
+
+void reportTextures()
+{
+	if (textureFormat == TextureFormatSRGB8)
+		glEnable(GL_FRAMEBUFFER_SRGB);
+	printf("Texture memory: %.1f MB as RGBA32F -> %.1f MB resident\n", m_shape.textureFloatBytes / 1048576.0, m_shape.textureBytes / 1048576.0);
+}
+
+// Point the bound arena VAO's instance attributes at crowdVBO, from instance first on
+void pointCrowdInstances(GLuint first)
+{
+	size_t base = first * sizeof(CrowdInstance);
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.crowdVBO);
+	for (int column = 0; column < 4; ++column)
+		glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(CrowdInstance), (GLvoid*)(base + offsetof(CrowdInstance, model) + column * sizeof(vec4)));
+	glVertexAttribIPointer(7, 1, GL_INT, sizeof(CrowdInstance), (GLvoid*)(base + offsetof(CrowdInstance, texture)));
+}
+
+// The same for the bound baked VAO and bakedVBO
+void pointBakedInstances(GLuint first)
+{
+	size_t base = first * sizeof(BakedInstance);
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.bakedVBO);
+	glVertexAttribPointer(8, 4, GL_FLOAT, GL_FALSE, sizeof(BakedInstance), (GLvoid*)(base + offsetof(BakedInstance, placement)));
+	glVertexAttribIPointer(9, 3, GL_INT, sizeof(BakedInstance), (GLvoid*)(base + offsetof(BakedInstance, texture)));
+}
+
+// Attach the shared per-instance buffer to the arena VAO, used by instanced and indirect draws
+void loadCrowd()
+{
+	glGenBuffers(1, &m_shape.crowdVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.crowdVBO);
+	glBufferData(GL_ARRAY_BUFFER, ROBOT_PART_COUNT * sizeof(CrowdInstance), NULL, GL_STREAM_DRAW);
+
+	glBindVertexArray(m_shape.arenaVAO);
+	pointCrowdInstances(0);
+	for (int location = 3; location <= 7; ++location)
+	{
+		glVertexAttribDivisor(location, 1);
+		glEnableVertexAttribArray(location);
+	}
+	glBindVertexArray(0);
+
+	// The baked crowd reads the arena's vertices through a VAO of its own
+	glGenVertexArrays(1, &m_shape.bakedVAO);
+	glBindVertexArray(m_shape.bakedVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.arenaVBO);
+	setVertexAttributes(vertexLayout);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_shape.arenaEBO);
+	glGenBuffers(1, &m_shape.bakedVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.bakedVBO);
+	glBufferData(GL_ARRAY_BUFFER, ROBOT_PART_COUNT * sizeof(BakedInstance), NULL, GL_STREAM_DRAW);
+	pointBakedInstances(0);
+	for (int location = 8; location <= 9; ++location)
+	{
+		glVertexAttribDivisor(location, 1);
+		glEnableVertexAttribArray(location);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 // OpenGL initialization
+void loadUniformBuffers()
+{
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Camera"), CAMERA_UBO_BINDING);
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Draw"), DRAW_UBO_BINDING);
+
+	glGenBuffers(1, &m_shape.cameraUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, m_shape.cameraUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_UBO_BINDING, m_shape.cameraUBO);
+
+	// Every Draw block starts on an offset the driver accepts for glBindBufferRange
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	m_shape.drawStride = (sizeof(DrawBlock) + alignment - 1) / alignment * alignment;
+	glGenBuffers(1, &m_shape.drawUBO);
+}
+
+// Once per frame, after the view is final
+void uploadCamera()
+{
+	CameraBlock camera = { view, projection };
+	glBindBuffer(GL_UNIFORM_BUFFER, m_shape.cameraUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(camera), &camera);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Draw blocks for the whole frame are queued first, uploaded in one call, then bound by range
+vector<unsigned char> drawBlocks;
+
+int queueDraw(const mat4& model, int layer)
+{
+	int index = (int)(drawBlocks.size() / m_shape.drawStride);
+	drawBlocks.resize(drawBlocks.size() + m_shape.drawStride);
+	DrawBlock* block = (DrawBlock*)&drawBlocks[(size_t)index * m_shape.drawStride];
+	block->model = model;
+	block->layer = layer;
+	return index;
+}
+
+void uploadDraws()
+{
+	// Respecifying the store orphans last frame's blocks instead of waiting for draws still reading them
+	glBindBuffer(GL_UNIFORM_BUFFER, m_shape.drawUBO);
+	glBufferData(GL_UNIFORM_BUFFER, drawBlocks.size(), drawBlocks.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	drawBlocks.clear();
+}
+
+void bindDraw(int index)
+{
+	glState.bindUniformRange(DRAW_UBO_BINDING, m_shape.drawUBO, (GLintptr)index * m_shape.drawStride, sizeof(DrawBlock));
+}
+
+void loadAnimations();
+void loadBakedPoses();
+
 void initialization()
 {
+	TraceScope trace("initialization");
 	glViewport(INIT_VIEWPORT_X, INIT_VIEWPORT_Y, INIT_VIEWPORT_WIDTH, INIT_VIEWPORT_HEIGHT);
 	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
 	glEnable(GL_DEPTH_TEST);
@@ -350,6 +1251,7 @@ void initialization()
 	// Load shader file
 	char **vertexShaderSource = loadShaderSource("asset/vertex.vs.glsl");
 	char **fragmentShaderSource = loadShaderSource("asset/fragment.fs.glsl");
+	defineShaderConstant(vertexShaderSource, "BAKED_MAX_CLIPS", BAKED_MAX_CLIPS);
 
 	// Assign content of these shader files to those shaders we created before
 	glShaderSource(vertexShader, 1, vertexShaderSource, NULL);
@@ -372,305 +1274,1240 @@ void initialization()
 	glAttachShader(program, fragmentShader);
 	glLinkProgram(program);
 
-	// Get the id of inner variable 'um4p' and 'um4mv' in shader programs
-	um4p = glGetUniformLocation(program, "um4p");
-	um4mv = glGetUniformLocation(program, "um4mv");
-	tex = glGetUniformLocation(program, "tex");
+	// Get the id of inner variables in shader programs; camera and per-draw data live in uniform blocks
+	textures = glGetUniformLocation(program, "textures");
+	instanced = glGetUniformLocation(program, "instanced");
+	baked = glGetUniformLocation(program, "baked");
+	bakedTime = glGetUniformLocation(program, "bakedTime");
+
+	// Tell OpenGL to use this shader program now
+	glState.useProgram(program);
+   
+	loadGrid(100, 50);
+
+	auto loadStart = chrono::steady_clock::now();
+	stbi_set_flip_vertically_on_load(true);
+	{
+		// Decodes finish on the loader threads and uploads in finish(), so both spans run through the drain
+		AssetLoader loader(loaderThreads);
+		TraceScope modelsTrace("loadModels");
+		loadModels(loader);
+		TraceScope texturesTrace("loadTextures");
+		loadTextures(loader);
+		TraceScope trace("Wait for asset uploads");
+		loader.finish();
+	}
+	vector<int> spareLayers;
+	for (int layer = m_shape.textureLayerCount - TEXTURE_SPARE_LAYERS; layer < m_shape.textureLayerCount; ++layer)
+		spareLayers.push_back(layer);
+	textureStreamer.init(m_shape.textureArray, textureInternalFormat(textureFormat), textureFormat == TextureFormatCompressed,
+		TEXTURE_ARRAY_SIZE, TEXTURE_STREAM_UNIT, spareLayers, m_shape.placeholderLayer, textureStreamed);
+	printf("Loaded assets in %.1f ms with %d loader threads\n", chrono::duration<double, milli>(chrono::steady_clock::now() - loadStart).count(), loaderThreads);
+	loadArena();
+	loadMultiDrawIndirect();
+	reportModels();
+	reportTextures();
+	loadCrowd();
+	loadUniformBuffers();
+	loadAnimations();
+	loadBakedPoses();
+
+	glState.uniform1i(textures, TEXTURE_ARRAY_UNIT);
+	glState.uniform1i(instanced, GL_FALSE);
+	
+	// perspective(fov, aspect_ratio, near_plane_distance, far_plane_distance)
+	// Setting projection way.
+	projection = perspective(radians(60.0f), (float)INIT_VIEWPORT_WIDTH / (float)INIT_VIEWPORT_HEIGHT, 0.1f, 1000.0f);
+
+	// lookAt(camera_position, camera_viewing_vector, up_vector)
+	// Setting Camera view
+	view = lookAt(vec3(-10.0f * cos(radians(cameraRotate.onZ)), 5.0f, -10.0f * sin(radians(cameraRotate.onZ))), vec3(1.0f, 1.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+}
+
+// Mesh slot for a part with world bounding sphere sphere, by its projected diameter. lod holds
+// the part's level from last frame; a level is only left once the size is LOD_HYSTERESIS past
+// its threshold, so parts near one do not flicker between meshes.
+int selectLod(int shapeID, const vec4& sphere, uint8_t& lod)
+{
+	const vector<int>& levels = m_shape.meshLods[shapeID];
+	if (!lodEnabled || levels.size() == 1)
+	{
+		lod = 0;
+		return levels[0];
+	}
+	float d = distance(lodCamera, vec3(sphere));
+	float pixels = d > sphere.w ? 2.0f * sphere.w * lodPixelScale / d : numeric_limits<float>::max();
+	int level = std::min((int)lod, (int)levels.size() - 1);
+	while (level + 1 < (int)levels.size() && pixels < lodPixelSizes[level] * (1.0f - LOD_HYSTERESIS))
+		level++;
+	while (level > 0 && pixels > lodPixelSizes[level - 1] * (1.0f + LOD_HYSTERESIS))
+		level--;
+	lod = level;
+	return levels[level];
+}
+
+void drawGrid(int drawIndex)
+{
+	glState.uniform1i(instanced, GL_FALSE);
+	glState.bindVertexArray(m_shape.gridVAO[0]);
+	bindDraw(drawIndex);
+	glDrawElements(GL_LINES, m_shape.gridLenght, GL_UNSIGNED_INT, NULL);
+}
+
+// How one robot part is built: its mesh, its texture and where it sits on its parent. The
+// part's pose and everything derived from it each frame live in its TransformHierarchy.
+class DrawObject
+{
+public:
+	const char* name;					// what animation clips call the joint
+	int shapeID;
+	int textureID;
+	RotateType initialRotate;
+	vec3 scale;
+	vec3 redirect;						// joint to mesh center
+	vec3 translate;						// parent's joint to this joint
+	DrawObject* parentBase;
+	int index = -1;						// place in its TransformHierarchy, the same in every clone
+
+	DrawObject(const char* joint, int shape, int texture, vec3 scal, vec3 redi, vec3 tran, RotateType rota, DrawObject* parent) : 
+		name(joint), shapeID(shape), textureID(texture), initialRotate(rota), scale(scal), redirect(redi), translate(tran), parentBase(parent) {}
+	~DrawObject(){}
+
+	int depth() const
+	{
+		int d = 0;
+		for (DrawObject* p = this->parentBase; p != NULL; p = p->parentBase)
+			++d;
+		return d;
+	}
+};
+
+// Pose and transform state of one rig as structure-of-arrays. Parts are kept in
+// parent-before-child order, so update() is one forward sweep over contiguous arrays
+// that rebuilds every world matrix exactly once per frame. The DrawObjects only
+// describe the parts and are shared with clones.
+class TransformHierarchy
+{
+public:
+	vector<DrawObject*> nodes;
+	vector<int> parents;				// index of each part's parent, -1 for the root
+
+	// Pose, written by the simulation or apply()
+	vector<vec3> shifts;
+	vector<quat> orientations;
+	vector<vec3> scales;
+
+	// Placement on the parent, fixed per part
+	vector<vec3> translates;
+	vector<vec3> redirects;
+
+	// Rebuilt by update() where the pose changed
+	vector<mat4> localMatrices;			// translate * rotate * redirect, relative to parent
+	vector<mat4> worldMatrices;			// parent world * local, inherited by children
+	vector<mat4> modelMatrices;			// world * scale, what actually gets drawn
+
+	// Per-frame render state
+	vector<vec4> worldSpheres;			// bounds of the mesh under modelMatrices, see updateBounds()
+	vector<uint8_t> visible;			// survived this frame's frustum test
+	vector<uint8_t> lods;				// level of detail, see selectLod()
+	vector<int> drawIndices;			// this frame's Draw block, see queueDraw()
+
+	TransformHierarchy(initializer_list<DrawObject*> objects) : nodes(objects)
+	{
+		stable_sort(nodes.begin(), nodes.end(), [](DrawObject* a, DrawObject* b) { return a->depth() < b->depth(); });
+		size_t count = nodes.size();
+		for (size_t i = 0; i < count; ++i)
+		{
+			DrawObject* node = nodes[i];
+			node->index = i;
+			parents.push_back(node->parentBase != NULL ? node->parentBase->index : -1);
+			restOrientations.push_back(jointRotation(node->initialRotate));
+			scales.push_back(node->scale);
+			translates.push_back(node->translate);
+			redirects.push_back(node->redirect);
+		}
+		shifts.assign(count, vec3(0.0f));
+		orientations = restOrientations;
+		localMatrices.assign(count, mat4(1.0f));
+		worldMatrices.assign(count, mat4(1.0f));
+		modelMatrices.assign(count, mat4(1.0f));
+		worldSpheres.assign(count, vec4(0.0f));
+		visible.assign(count, 1);
+		lods.assign(count, 0);
+		drawIndices.assign(count, -1);
+		dirty.assign(count, 1);
+		moved.assign(count, 0);
+		boundsStale.assign(count, 1);
+		cachedShifts.assign(count, vec3(0.0f));
+		cachedOrientations.assign(count, quat());
+		cachedScales.assign(count, vec3(0.0f));
+		findLevels();
+	}
+
+	TransformHierarchy() {}
+
+	// Independent copy of the rig's state
+	TransformHierarchy clone() const
+	{
+		TransformHierarchy copy = *this;
+		copy.dirty.assign(nodes.size(), 1);
+		return copy;
+	}
+
+	// The rig repeated copies times as one hierarchy, for benchmarks. Copies are interleaved
+	// level by level, so the result is still parent-before-child with contiguous levels.
+	TransformHierarchy replicate(int copies) const
+	{
+		vector<pair<int, int>> order;		// (copy, part) in the new order
+		for (size_t level = 0; level + 1 < levelStarts.size(); ++level)
+			for (int copy = 0; copy < copies; ++copy)
+				for (int i = levelStarts[level]; i < levelStarts[level + 1]; ++i)
+					order.push_back({ copy, i });
+		vector<int> placed((size_t)copies * nodes.size());
+		for (size_t k = 0; k < order.size(); ++k)
+			placed[(size_t)order[k].first * nodes.size() + order[k].second] = k;
+
+		TransformHierarchy copy;
+		auto pick = [&](auto& to, const auto& from) {
+			to.clear();
+			for (const pair<int, int>& source : order)
+				to.push_back(from[source.second]);
+		};
+		pick(copy.nodes, nodes);
+		pick(copy.shifts, shifts);
+		pick(copy.orientations, orientations);
+		pick(copy.restOrientations, restOrientations);
+		pick(copy.scales, scales);
+		pick(copy.translates, translates);
+		pick(copy.redirects, redirects);
+		pick(copy.localMatrices, localMatrices);
+		pick(copy.worldMatrices, worldMatrices);
+		pick(copy.modelMatrices, modelMatrices);
+		pick(copy.worldSpheres, worldSpheres);
+		pick(copy.visible, visible);
+		pick(copy.lods, lods);
+		pick(copy.drawIndices, drawIndices);
+		pick(copy.moved, moved);
+		pick(copy.boundsStale, boundsStale);
+		pick(copy.cachedShifts, cachedShifts);
+		pick(copy.cachedOrientations, cachedOrientations);
+		pick(copy.cachedScales, cachedScales);
+		for (const pair<int, int>& source : order)
+		{
+			int parent = parents[source.second];
+			copy.parents.push_back(parent >= 0 ? placed[(size_t)source.first * nodes.size() + parent] : -1);
+		}
+		copy.dirty.assign(order.size(), 1);
+		copy.findLevels();
+		return copy;
+	}
+
+	// Rebuild local/world matrices of the parts whose pose or parent changed since last frame
+	void update()
+	{
+		if (batchedTransforms)
+			updateBatched();
+		else
+			updateEach();
+	}
+
+	// Each changed part through glm::mat4_cast/translate/scale products
+	void updateEach()
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			int parent = parents[i];
+			bool localChanged = dirty[i] || shifts[i] != cachedShifts[i] || orientations[i] != cachedOrientations[i];
+			bool scaleChanged = dirty[i] || scales[i] != cachedScales[i];
+
+			if (localChanged)
+			{
+				localMatrices[i] = glm::translate(mat4(1.0f), shifts[i] + translates[i]) * mat4_cast(orientations[i]) * glm::translate(mat4(1.0f), redirects[i]);
+				cachedShifts[i] = shifts[i];
+				cachedOrientations[i] = orientations[i];
+			}
+
+			moved[i] = localChanged || (parent >= 0 && moved[parent]);
+			if (moved[i])
+				worldMatrices[i] = parent >= 0 ? worldMatrices[parent] * localMatrices[i] : localMatrices[i];
+
+			if (moved[i] || scaleChanged)
+			{
+				modelMatrices[i] = worldMatrices[i] * glm::scale(mat4(1.0f), scales[i]);
+				cachedScales[i] = scales[i];
+				boundsStale[i] = true;
+			}
+			dirty[i] = false;
+		}
+	}
+
+	// Same change tracking, but any change recomposes the whole rig with composeJoints(),
+	// one depth level at a time
+	void updateBatched()
+	{
+		bool changed = false;
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			int parent = parents[i];
+			bool localChanged = dirty[i] || shifts[i] != cachedShifts[i] || orientations[i] != cachedOrientations[i];
+			bool scaleChanged = dirty[i] || scales[i] != cachedScales[i];
+			cachedShifts[i] = shifts[i];
+			cachedOrientations[i] = orientations[i];
+			cachedScales[i] = scales[i];
+			moved[i] = localChanged || (parent >= 0 && moved[parent]);
+			if (moved[i] || scaleChanged)
+			{
+				boundsStale[i] = true;
+				changed = true;
+			}
+			dirty[i] = false;
+		}
+		if (!changed)
+			return;
+
+		JointArrays joints = { parents.data(), shifts.data(), translates.data(), redirects.data(), scales.data(), 
+			orientations.data(), localMatrices.data(), worldMatrices.data(), modelMatrices.data() };
+		for (size_t level = 0; level + 1 < levelStarts.size(); ++level)
+			composeJoints(joints, levelStarts[level], levelStarts[level + 1]);
+	}
+
+	// Orientations are those of the last update()
+	void capture(PartPose* parts) const
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+			parts[i] = { shifts[i], orientations[i] };
+	}
+
+	void apply(const PartPose* parts)
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			shifts[i] = parts[i].shift;
+			orientations[i] = parts[i].orientation;
+		}
+	}
+
+	// Back to the pose the rig was built with
+	void reset()
+	{
+		shifts.assign(nodes.size(), vec3(0.0f));
+		orientations = restOrientations;
+	}
+
+	// Refresh world spheres where a model matrix changed; the mesh bounds must be loaded.
+	// The radius grows by the largest axis scale, so it stays conservative under any scale.
+	void updateBounds()
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			if (!boundsStale[i])
+				continue;
+			const MeshBounds& mesh = m_shape.meshBounds[nodes[i]->shapeID];
+			const mat4& model = modelMatrices[i];
+			float scale = std::max(std::max(length(vec3(model[0])), length(vec3(model[1]))), length(vec3(model[2])));
+			worldSpheres[i] = vec4(vec3(model * vec4(vec3(mesh.sphere), 1.0f)), mesh.sphere.w * scale);
+			boundsStale[i] = false;
+		}
+	}
+
+	// Radius around the root joint that holds the rig in any pose: every joint may rotate
+	// freely and every non-root joint may shift by up to shiftReach
+	float reach(float shiftReach) const
+	{
+		vector<float> jointDistance(nodes.size(), 0.0f);
+		float radius = 0.0f;
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			int parent = parents[i];
+			if (parent >= 0)
+				jointDistance[i] = jointDistance[parent] + length(redirects[parent] + translates[i]) + shiftReach;
+			const MeshBounds& mesh = m_shape.meshBounds[nodes[i]->shapeID];
+			float scale = std::max(std::max(scales[i].x, scales[i].y), scales[i].z);
+			radius = std::max(radius, jointDistance[i] + length(redirects[i] + scales[i] * vec3(mesh.sphere)) + mesh.sphere.w * scale);
+		}
+		return radius;
+	}
+
+	// Sphere around every part's world sphere
+	vec4 bounds() const
+	{
+		vec3 low = vec3(numeric_limits<float>::max()), high = -low;
+		for (const vec4& sphere : worldSpheres)
+		{
+			low = glm::min(low, vec3(sphere) - sphere.w);
+			high = glm::max(high, vec3(sphere) + sphere.w);
+		}
+		vec3 center = 0.5f * (low + high);
+		float radius = 0.0f;
+		for (const vec4& sphere : worldSpheres)
+			radius = std::max(radius, distance(center, vec3(sphere)) + sphere.w);
+		return vec4(center, radius);
+	}
+
+	// Mark parts outside the frustum; returns how many are visible
+	int cull(const Frustum& frustum)
+	{
+		if (!cullingEnabled)
+		{
+			visible.assign(nodes.size(), 1);
+			return nodes.size();
+		}
+		return cullSpheres(frustum, worldSpheres.data(), worldSpheres.size(), visible.data());
+	}
+
+	// Pick the level of detail of every visible part; returns the triangles they will draw
+	int64_t selectLods()
+	{
+		int64_t triangles = 0;
+		for (size_t i = 0; i < nodes.size(); ++i)
+			if (visible[i])
+				triangles += m_shape.indexCounts[selectLod(nodes[i]->shapeID, worldSpheres[i], lods[i])] / 3;
+		return triangles;
+	}
+
+	void queueDraws()
+	{
+		for (size_t i = 0; i < nodes.size(); ++i)
+			if (visible[i])
+				drawIndices[i] = queueDraw(modelMatrices[i], m_shape.textureLayers[nodes[i]->textureID]);
+	}
+
+	// Every part shares the program, the arena VAO and the array texture (its layer comes
+	// with the Draw block), so draws are only sorted by mesh to keep its vertices warm
+	void draw()
+	{
+		if (drawOrder.size() != nodes.size())
+		{
+			drawOrder.clear();
+			for (size_t i = 0; i < nodes.size(); ++i)
+				drawOrder.push_back(i);
+			stable_sort(drawOrder.begin(), drawOrder.end(), [&](int a, int b) { return nodes[a]->shapeID < nodes[b]->shapeID; });
+		}
+		glState.bindVertexArray(m_shape.arenaVAO);
+		for (int i : drawOrder)
+		{
+			if (!visible[i])
+				continue;
+			bindDraw(drawIndices[i]);
+			int slot = m_shape.meshLods[nodes[i]->shapeID][lods[i]];
+			glDrawElementsBaseVertex(GL_TRIANGLES, m_shape.indexCounts[slot], GL_UNSIGNED_INT, 
+				(GLvoid*)(m_shape.firstIndices[slot] * sizeof(uint32_t)), m_shape.baseVertices[slot]);
+		}
+	}
+
+private:
+	vector<quat> restOrientations;		// of each part's initialRotate
+
+	// Change tracking for update(), compared against the pose each frame
+	vector<uint8_t> dirty;
+	vector<uint8_t> moved;
+	vector<uint8_t> boundsStale;
+	vector<vec3> cachedShifts;
+	vector<quat> cachedOrientations;
+	vector<vec3> cachedScales;
+	vector<int> levelStarts;			// first part of each depth level, then the part count
+	vector<int> drawOrder;				// parts sorted by mesh, built on first draw
+
+	void findLevels()
+	{
+		vector<int> depth(nodes.size(), 0);
+		levelStarts.clear();
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			if (parents[i] >= 0)
+				depth[i] = depth[parents[i]] + 1;
+			if (i == 0 || depth[i] != depth[i - 1])
+				levelStarts.push_back(i);
+		}
+		levelStarts.push_back(nodes.size());
+	}
+};
+
+DrawObject bodyDO = DrawObject("body", Cube, TextureTorso, 
+	vec3(1.0f, 2.0f, 1.2f), vec3(0.0f), vec3(0.0f, 3.0f, 0.0f), RotateType(0.0f, 0.0f, 0.0f), NULL);
+DrawObject headDO = DrawObject("head", Sphere, TextureHead, 
+	vec3(1.0f, 1.0f, 1.0f), vec3(0.0f), vec3(0.0f, 1.5f, 0.0f), RotateType(), &bodyDO);
+DrawObject leftHornDO = DrawObject("leftHorn", Cone, TextureHorn, 
+	vec3(0.15f, 0.15f, 0.15f), vec3(0.0f, 0.15f, 0.0f), vec3(0.0f, 0.45f * cos(radians(30.0f)), 0.45f * sin(radians(30.0f))), RotateType(30.0f, 0.0f, 0.0f), &headDO);
+DrawObject RigftHornDO = DrawObject("rightHorn", Cone, TextureHorn, 
+	vec3(0.15f, 0.15f, 0.15f), vec3(0.0f, 0.15f, 0.0f), vec3(0.0f, 0.45f * cos(radians(-30.0f)), 0.45f * sin(radians(-30.0f))), RotateType(-30.0f, 0.0f, 0.0f), &headDO);
+DrawObject leftUpperarmDO = DrawObject("leftUpperarm", Cube, TextureUpperarm, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, 1.0f, 0.85f), RotateType(), &bodyDO);
+DrawObject leftForearmDO = DrawObject("leftForearm", Cube, TextureForearm, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &leftUpperarmDO);
+DrawObject rightUpperarmDO = DrawObject("rightUpperarm", Cube, TextureUpperarm, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, 1.0f, -0.85f), RotateType(), &bodyDO);
+DrawObject rightForearmDO = DrawObject("rightForearm", Cube, TextureForearm, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &rightUpperarmDO);
+DrawObject leftThighDO = DrawObject("leftThigh", Cube, TextureLThigh, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -1.0f, 0.35f), RotateType(), &bodyDO);
+DrawObject leftCalfDO = DrawObject("leftCalf", Cube, TextureCalf, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &leftThighDO);
+DrawObject rightThighDO = DrawObject("rightThigh", Cube, TextureRThigh, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -1.0f, -0.35f), RotateType(), &bodyDO);
+DrawObject rightCalfDO = DrawObject("rightCalf", Cube, TextureCalf, 
+	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &rightThighDO);
+
+TransformHierarchy robotHierarchy = {
+	&bodyDO, &headDO, &leftHornDO, &RigftHornDO, 
+	&leftUpperarmDO, &leftForearmDO, &rightUpperarmDO, &rightForearmDO,
+	&leftThighDO, &leftCalfDO, &rightThighDO, &rightCalfDO
+};
+
+// The named DrawObjects above belong to the simulation. Rendering draws this copy,
+// posed between the last two simulation ticks.
+TransformHierarchy renderHierarchy = robotHierarchy.clone();
+RobotPose simPose;	// pose after the latest tick, simulation side only
+
+// Everything the renderer needs from one simulation tick, never modified once published
+struct PoseSnapshot
+{
+	RobotPose previous;
+	RobotPose current;
+	chrono::steady_clock::time_point tickTime;	// when current was produced
+	bool sakanaEnabled;
+};
+
+TripleBuffer<PoseSnapshot> poseBuffer;
+
+// Input and GUI actions that change simulation state, run before the next tick
+CompletionQueue<function<void()>> simCommands;
+
+void updateRobot()
+{
+	renderHierarchy.update();
+}
+
+void drawInstanced(int count);
+
+void drawRobot()
+{
+	if (indirectEnabled)
+	{
+		drawInstanced(1);
+		return;
+	}
+	glState.uniform1i(instanced, GL_FALSE);
+	renderHierarchy.draw();
+}
+
+// Robots of a crowd stand on a square lattice around the controlled robot and copy its pose
+vec3 crowdOffset(int index, int count)
+{
+	int side = (int)ceil(sqrt((float)count));
+	return CROWD_SPACING * vec3((float)(index % side - side / 2), 0.0f, (float)(index / side - side / 2));
+}
+
+vector<int> crowdSlots;						// mesh slots in command order, every level of each shape the rig uses
+vector<vector<CrowdInstance>> slotInstances;	// this frame's instances of each mesh slot
+vector<uint8_t> crowdLods;					// level of detail of every robot's parts, robot-major
+vector<CrowdInstance> crowdInstances;
+vector<vector<BakedInstance>> bakedSlotInstances;	// the same for the baked crowd
+vector<BakedInstance> bakedInstances;
+vec4 bakedBounds;							// around every baked pose, relative to the robot's position
+CrowdGrid bakedGrid;						// the baked crowd's own lattice, as drawInstanced(1) draws the robot
+int bakedGridCount = 0;
+vector<uint8_t> bakedLods;
+vector<vec4> bakedPartSpheres;				// each baked clip's parts at its first sample, for levels of detail
+vector<DrawElementsIndirectCommand> indirectCommands;
+
+// Frustum culling results of the last robot pass
+struct CullStats
+{
+	int robots = 0;
+	int visibleRobots = 0;
+	int parts = 0;
+	int visibleParts = 0;
+	int64_t frames = 0;
+	int64_t triangles = 0;
+	int64_t totalParts = 0;
+	int64_t totalVisibleParts = 0;
+	int64_t totalTriangles = 0;
+
+	void record(int robotCount, int robotsLeft, int partCount, int partsLeft, int64_t trianglesDrawn)
+	{
+		frames++;
+		robots = visibleRobots = parts = visibleParts = 0;
+		triangles = 0;
+		add(robotCount, robotsLeft, partCount, partsLeft, trianglesDrawn);
+	}
 
-	// Tell OpenGL to use this shader program now
-	glUseProgram(program);
-   
-	loadGrid(100, 50);
-	loadModels();
-	loadTextures();
-	
-	// perspective(fov, aspect_ratio, near_plane_distance, far_plane_distance)
-	// Setting projection way.
-	projection = perspective(radians(60.0f), (float)INIT_VIEWPORT_WIDTH / (float)INIT_VIEWPORT_HEIGHT, 0.1f, 1000.0f);
+	// Another pass in the frame last recorded
+	void add(int robotCount, int robotsLeft, int partCount, int partsLeft, int64_t trianglesDrawn)
+	{
+		robots += robotCount;
+		visibleRobots += robotsLeft;
+		parts += partCount;
+		visibleParts += partsLeft;
+		triangles += trianglesDrawn;
+		totalParts += partCount;
+		totalVisibleParts += partsLeft;
+		totalTriangles += trianglesDrawn;
+	}
+};
 
-	// lookAt(camera_position, camera_viewing_vector, up_vector)
-	// Setting Camera view
-	view = lookAt(vec3(-10.0f * cos(radians(cameraRotate.onZ)), 5.0f, -10.0f * sin(radians(cameraRotate.onZ))), vec3(1.0f, 1.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+CullStats cullStats;
+Frustum viewFrustum;		// of this frame's camera, set in display()
+CrowdGrid crowdGrid;		// crowd lattice positions, relative to the controlled robot's root
+int crowdGridCount = 0;		// crowd size crowdGrid was built for
+float robotReach = 0.0f;	// TransformHierarchy::reach() of the render rig
+vector<vec4> robotSpheres;
+vector<vec4> partSpheres;
+vector<uint8_t> robotVisibility;
+vector<uint8_t> partVisibility;
+vector<int> insideRobots;	// wholly in the frustum in any pose
+vector<int> edgeRobots;		// visible, but their parts need their own test
+
+// Mesh slots of the crowd's commands, found on first use
+void prepareCrowdSlots()
+{
+	if (!crowdSlots.empty())
+		return;
+	vector<int> shapes;
+	for (DrawObject* node : renderHierarchy.nodes)
+		if (find(shapes.begin(), shapes.end(), node->shapeID) == shapes.end())
+			shapes.push_back(node->shapeID);
+	for (int shape : shapes)
+		crowdSlots.insert(crowdSlots.end(), m_shape.meshLods[shape].begin(), m_shape.meshLods[shape].end());
+	slotInstances.resize(m_shape.indexCounts.size());
+	bakedSlotInstances.resize(m_shape.indexCounts.size());
 }
 
-void drawGrid()
+// Robots keep their place on the lattice, so a grid is only rebuilt when the crowd size changes
+void placeCrowd(CrowdGrid& grid, int& gridCount, int count)
 {
-	glBindVertexArray(m_shape.gridVAO[0]);
-	glUniform1i(tex, TextureKuro);
-	// Transfer value of (view*model) to both shader's inner variable 'um4mv';
-	glUniformMatrix4fv(um4mv, 1, GL_FALSE, value_ptr(view * mat4(1.0f)));
-	// Transfer value of projection to both shader's inner variable 'um4p';
-	glUniformMatrix4fv(um4p, 1, GL_FALSE, value_ptr(projection));
-	glDrawElements(GL_LINES, m_shape.gridLenght, GL_UNSIGNED_INT, NULL);
-	glBindVertexArray(0);
+	if (gridCount == count)
+		return;
+	vector<vec3> positions(count);
+	for (int r = 0; r < count; ++r)
+		positions[r] = crowdOffset(r, count);
+	grid.build(positions, CROWD_GRID_CELL);
+	gridCount = count;
 }
 
-class DrawObject
+void submitInstanced(GLuint vao, void (*pointInstances)(GLuint first));
+
+// count robots as instances of their parts: one command per mesh, each instance finding
+// its model matrix and texture layer through baseInstance. With indirect draws on, the
+// commands go to the GPU and the whole pass is a single submission. Robots, then the
+// parts of the robots left, are culled against the frustum before anything is written.
+// Every level of detail is a mesh of its own, so each gets its own command.
+void drawInstanced(int count)
 {
-public:
-	int shapeID;
-	int textureID;
-	RotateType rotate;
-	RotateType initialRotate;
-	vec3 shift = vec3(0.0f);
-	vec3 scale;
-	vec3 redirect;
-	vec3 translate;
-	mat4 translateMatrix = mat4(1.0f);
-	mat4 scaleMatrix = mat4(1.0f);
-	// mat4 relativeMatrix(1.0f);
-	mat4 redirectMatrix = mat4(1.0f);
-	mat4 rotateXMatrix = mat4(1.0f);
-	mat4 rotateZMatrix = mat4(1.0f);
-	mat4 rotateYMatrix = mat4(1.0f);
-	mat4 rotateMatrix = mat4(1.0f);
-	DrawObject* parentBase;
+	const TransformHierarchy& rig = renderHierarchy;
+	const vector<DrawObject*>& nodes = rig.nodes;
+	int partCount = nodes.size();
+	prepareCrowdSlots();
+	if (crowdLods.size() != (size_t)count * partCount)
+		crowdLods.assign((size_t)count * partCount, 0);
+
+	// Robots keep their place on the lattice around the controlled robot, so the grid is
+	// built once per crowd size and each query is moved to the root joint instead of refitting.
+	// Grid cells are grown by the any-pose reach; robots in cells that straddle a plane are
+	// then tested against a sphere around this frame's pose.
+	insideRobots.clear();
+	edgeRobots.clear();
+	if (cullingEnabled)
+	{
+		if (robotReach == 0.0f)
+			robotReach = renderHierarchy.reach(robotShiftReach);
+		placeCrowd(crowdGrid, crowdGridCount, count);
+		crowdGrid.query(viewFrustum, vec3(rig.worldMatrices[0][3]), robotReach, insideRobots, edgeRobots);
+
+		vec4 robot = renderHierarchy.bounds();
+		robotSpheres.resize(edgeRobots.size());
+		robotVisibility.resize(edgeRobots.size());
+		for (size_t e = 0; e < edgeRobots.size(); ++e)
+			robotSpheres[e] = vec4(vec3(robot) + crowdOffset(edgeRobots[e], count), robot.w);
+		cullSpheres(viewFrustum, robotSpheres.data(), robotSpheres.size(), robotVisibility.data());
+		size_t kept = 0;
+		for (size_t e = 0; e < edgeRobots.size(); ++e)
+			if (robotVisibility[e])
+				edgeRobots[kept++] = edgeRobots[e];
+		edgeRobots.resize(kept);
+	}
+	else
+	{
+		for (int r = 0; r < count; ++r)
+			insideRobots.push_back(r);
+	}
 
-	DrawObject(int shape, int texture, vec3 scal, vec3 redi, vec3 tran, RotateType rota, DrawObject* parent) : 
-		shapeID(shape), textureID(texture), scale(scal), redirect(redi), translate(tran), initialRotate(rota), rotate(rota), parentBase(parent) {}
-	~DrawObject(){}
+	int edgeCount = edgeRobots.size();
+	partVisibility.assign((size_t)edgeCount * partCount, 1);
+	partSpheres.resize((size_t)edgeCount * partCount);
+	for (int e = 0; e < edgeCount; ++e)
+	{
+		vec3 offset = crowdOffset(edgeRobots[e], count);
+		for (int p = 0; p < partCount; ++p)
+			partSpheres[e * partCount + p] = vec4(vec3(rig.worldSpheres[p]) + offset, rig.worldSpheres[p].w);
+	}
+	cullSpheres(viewFrustum, partSpheres.data(), partSpheres.size(), partVisibility.data());
+
+	// Instances go to the bucket of their mesh slot, then the buckets are laid out one after
+	// another so each slot is one contiguous range
+	for (int slot : crowdSlots)
+		slotInstances[slot].clear();
+	auto addPart = [&](int r, const mat4& root, int p) {
+		vec4 sphere = vec4(vec3(rig.worldSpheres[p]) + vec3(root[3]), rig.worldSpheres[p].w);
+		int slot = selectLod(nodes[p]->shapeID, sphere, crowdLods[(size_t)r * partCount + p]);
+		slotInstances[slot].push_back({ root * rig.modelMatrices[p], m_shape.textureLayers[nodes[p]->textureID] });
+	};
+	for (int r : insideRobots)
+	{
+		mat4 root = glm::translate(mat4(1.0f), crowdOffset(r, count));
+		for (int p = 0; p < partCount; ++p)
+			addPart(r, root, p);
+	}
+	for (int e = 0; e < edgeCount; ++e)
+	{
+		mat4 root = glm::translate(mat4(1.0f), crowdOffset(edgeRobots[e], count));
+		for (int p = 0; p < partCount; ++p)
+			if (partVisibility[e * partCount + p])
+				addPart(edgeRobots[e], root, p);
+	}
 
-	void draw(int shapeID, int textureID, mat4 modelMatrix)
+	crowdInstances.clear();
+	indirectCommands.clear();
+	int64_t triangles = 0;
+	for (int slot : crowdSlots)
 	{
-		glBindVertexArray(m_shape.robotVAO[shapeID]);
+		const vector<CrowdInstance>& instances = slotInstances[slot];
+		if (instances.empty())
+			continue;
+		indirectCommands.push_back({ (GLuint)m_shape.indexCounts[slot], (GLuint)instances.size(), 
+			(GLuint)m_shape.firstIndices[slot], m_shape.baseVertices[slot], (GLuint)crowdInstances.size() });
+		crowdInstances.insert(crowdInstances.end(), instances.begin(), instances.end());
+		triangles += (int64_t)(m_shape.indexCounts[slot] / 3) * instances.size();
+	}
+	int robotsLeft = insideRobots.size() + edgeCount;
+	cullStats.record(count, robotsLeft, count * partCount, crowdInstances.size(), triangles);
+	if (indirectCommands.empty())
+		return;
+
+	// Respecified at this frame's size, which also orphans last frame's instances
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.crowdVBO);
+	glBufferData(GL_ARRAY_BUFFER, crowdInstances.size() * sizeof(CrowdInstance), crowdInstances.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-		glUniform1i(tex, textureID);
-		glUniformMatrix4fv(um4mv, 1, GL_FALSE, value_ptr(view * modelMatrix));
-		glUniformMatrix4fv(um4p, 1, GL_FALSE, value_ptr(projection));
+	glState.uniform1i(instanced, GL_TRUE);
+	glState.uniform1i(baked, GL_FALSE);
+	submitInstanced(m_shape.arenaVAO, pointCrowdInstances);
+}
 
-		glDrawArrays(GL_TRIANGLES, 0, m_shape.vertexCounts[shapeID]);
+// Draw indirectCommands from vao, its instances already uploaded. pointInstances moves vao's
+// instance attributes to a command's first instance where base instances are missing.
+void submitInstanced(GLuint vao, void (*pointInstances)(GLuint first))
+{
+	glState.bindVertexArray(vao);
+	if (drawElementsBaseInstance == NULL)
+	{
+		// Every draw starts at instance 0 here, so the attributes move to each command's range instead
+		for (const DrawElementsIndirectCommand& command : indirectCommands)
+		{
+			pointInstances(command.baseInstance);
+			glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command.count, GL_UNSIGNED_INT, (GLvoid*)(command.firstIndex * sizeof(uint32_t)), 
+				command.instanceCount, command.baseVertex);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+	if (!indirectEnabled)
+	{
+		for (const DrawElementsIndirectCommand& command : indirectCommands)
+			drawElementsBaseInstance(GL_TRIANGLES, command.count, GL_UNSIGNED_INT, (GLvoid*)(command.firstIndex * sizeof(uint32_t)), 
+				command.instanceCount, command.baseVertex, command.baseInstance);
+		return;
 	}
 
-	void drawPass(int shapeID, int textureID, mat4 relativeMatrix)
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_shape.indirectBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, indirectCommands.size() * sizeof(DrawElementsIndirectCommand), indirectCommands.data(), GL_STREAM_DRAW);
+	if (multiDrawElementsIndirect != NULL)
+		multiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, NULL, indirectCommands.size(), 0);
+	else
+		for (size_t i = 0; i < indirectCommands.size(); ++i)
+			glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (GLvoid*)(i * sizeof(DrawElementsIndirectCommand)));
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+// The crowd around the robot as background characters playing bakedCrowdClip on the GPU,
+// each at a phase of its own. An instance only names its part, clip and phase: the vertex
+// shader looks the part's matrix up in the baked poses, so nothing is posed, multiplied or
+// streamed per part on the CPU. Robots are culled whole against the bounds of every baked
+// pose, and their parts pick a level of detail by where they stand at the clip's start.
+// The lattice point under the robot itself is left to drawInstanced().
+void drawBakedCrowd(int count)
+{
+	const vector<DrawObject*>& nodes = renderHierarchy.nodes;
+	int partCount = nodes.size();
+	prepareCrowdSlots();
+	if (bakedLods.size() != (size_t)count * partCount)
+		bakedLods.assign((size_t)count * partCount, 0);
+	int side = (int)ceil(sqrt((float)count));
+	int center = (side / 2) * side + side / 2;		// where crowdOffset() is zero
+	int robots = center < count ? count - 1 : count;
+	vec3 root = vec3(renderHierarchy.worldMatrices[0][3]);
+	vec3 origin = vec3(root.x, 0.0f, root.z);
+
+	insideRobots.clear();
+	edgeRobots.clear();
+	if (cullingEnabled)
 	{
-		this->redirectMatrix  = glm::translate(mat4(1.0f), this->redirect);
-		this->rotateXMatrix   = glm::rotate(mat4(1.0f), radians(this->rotate.onX), vec3(1.0f, 0.0f, 0.0f));
-		this->rotateYMatrix   = glm::rotate(mat4(1.0f), radians(this->rotate.onZ), vec3(0.0f, 1.0f, 0.0f));
-		this->rotateZMatrix   = glm::rotate(mat4(1.0f), radians(this->rotate.onY), vec3(0.0f, 0.0f, 1.0f));
-		this->rotateMatrix    = this->rotateYMatrix * this->rotateZMatrix * this->rotateXMatrix;
-		this->translateMatrix = glm::translate(mat4(1.0f), this->shift + this->translate);
-		relativeMatrix  = this->translateMatrix * this->rotateMatrix * this->redirectMatrix * relativeMatrix;
-		
-		if (this->parentBase != NULL)
-			parentBase->drawPass(shapeID, textureID, relativeMatrix);
-		else
-			this->draw(shapeID, textureID, relativeMatrix);
+		placeCrowd(bakedGrid, bakedGridCount, count);
+		bakedGrid.query(viewFrustum, origin + vec3(bakedBounds), bakedBounds.w, insideRobots, edgeRobots);
+		robotSpheres.resize(edgeRobots.size());
+		robotVisibility.resize(edgeRobots.size());
+		for (size_t e = 0; e < edgeRobots.size(); ++e)
+			robotSpheres[e] = vec4(origin + vec3(bakedBounds) + crowdOffset(edgeRobots[e], count), bakedBounds.w);
+		cullSpheres(viewFrustum, robotSpheres.data(), robotSpheres.size(), robotVisibility.data());
+		for (size_t e = 0; e < edgeRobots.size(); ++e)
+			if (robotVisibility[e])
+				insideRobots.push_back(edgeRobots[e]);
+	}
+	else
+	{
+		for (int r = 0; r < count; ++r)
+			insideRobots.push_back(r);
 	}
 
-	void drawSelf()
+	for (int slot : crowdSlots)
+		bakedSlotInstances[slot].clear();
+	int clip = bakedCrowdClip;
+	const vec4* spheres = &bakedPartSpheres[(size_t)clip * partCount];
+	int robotsLeft = 0;
+	for (int r : insideRobots)
 	{
-		this->scaleMatrix = glm::scale(mat4(1.0f), this->scale);
-		this->drawPass(this->shapeID, this->textureID, this->scaleMatrix);
+		if (r == center)
+			continue;
+		robotsLeft++;
+		vec4 placement = vec4(origin + crowdOffset(r, count), fract((float)r * 0.618034f));	// golden ratio spreads the phases
+		for (int p = 0; p < partCount; ++p)
+		{
+			vec4 sphere = vec4(vec3(spheres[p]) + vec3(placement), spheres[p].w);
+			int slot = selectLod(nodes[p]->shapeID, sphere, bakedLods[(size_t)r * partCount + p]);
+			bakedSlotInstances[slot].push_back({ placement, m_shape.textureLayers[nodes[p]->textureID], p, clip });
+		}
 	}
 
-	void reset()
+	bakedInstances.clear();
+	indirectCommands.clear();
+	int64_t triangles = 0;
+	for (int slot : crowdSlots)
 	{
-		this->shift = vec3(0.0f);
-		this->rotate = initialRotate;
+		const vector<BakedInstance>& instances = bakedSlotInstances[slot];
+		if (instances.empty())
+			continue;
+		indirectCommands.push_back({ (GLuint)m_shape.indexCounts[slot], (GLuint)instances.size(), 
+			(GLuint)m_shape.firstIndices[slot], m_shape.baseVertices[slot], (GLuint)bakedInstances.size() });
+		bakedInstances.insert(bakedInstances.end(), instances.begin(), instances.end());
+		triangles += (int64_t)(m_shape.indexCounts[slot] / 3) * instances.size();
 	}
-};
+	cullStats.add(robots, robotsLeft, robots * partCount, bakedInstances.size(), triangles);
+	if (indirectCommands.empty())
+		return;
 
-DrawObject bodyDO = DrawObject(Cube, TextureTorso, 
-	vec3(1.0f, 2.0f, 1.2f), vec3(0.0f), vec3(0.0f, 3.0f, 0.0f), RotateType(0.0f, 0.0f, 0.0f), NULL);
-DrawObject headDO = DrawObject(Sphere, TextureHead, 
-	vec3(1.0f, 1.0f, 1.0f), vec3(0.0f), vec3(0.0f, 1.5f, 0.0f), RotateType(), &bodyDO);
-DrawObject leftHornDO = DrawObject(Cone, TextureHorn, 
-	vec3(0.15f, 0.15f, 0.15f), vec3(0.0f, 0.15f, 0.0f), vec3(0.0f, 0.45f * cos(radians(30.0f)), 0.45f * sin(radians(30.0f))), RotateType(30.0f, 0.0f, 0.0f), &headDO);
-DrawObject RigftHornDO = DrawObject(Cone, TextureHorn, 
-	vec3(0.15f, 0.15f, 0.15f), vec3(0.0f, 0.15f, 0.0f), vec3(0.0f, 0.45f * cos(radians(-30.0f)), 0.45f * sin(radians(-30.0f))), RotateType(-30.0f, 0.0f, 0.0f), &headDO);
-DrawObject leftUpperarmDO = DrawObject(Cube, TextureUpperarm, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, 1.0f, 0.85f), RotateType(), &bodyDO);
-DrawObject leftForearmDO = DrawObject(Cube, TextureForearm, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &leftUpperarmDO);
-DrawObject rightUpperarmDO = DrawObject(Cube, TextureUpperarm, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, 1.0f, -0.85f), RotateType(), &bodyDO);
-DrawObject rightForearmDO = DrawObject(Cube, TextureForearm, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &rightUpperarmDO);
-DrawObject leftThighDO = DrawObject(Cube, TextureLThigh, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -1.0f, 0.35f), RotateType(), &bodyDO);
-DrawObject leftCalfDO = DrawObject(Cube, TextureCalf, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &leftThighDO);
-DrawObject rightThighDO = DrawObject(Cube, TextureRThigh, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -1.0f, -0.35f), RotateType(), &bodyDO);
-DrawObject rightCalfDO = DrawObject(Cube, TextureCalf, 
-	vec3(0.5f, 1.0f, 0.5f), vec3(0.0f, -0.5f, 0.0f), vec3(0.0f, -0.5f, 0.0f), RotateType(), &rightThighDO);
+	glBindBuffer(GL_ARRAY_BUFFER, m_shape.bakedVBO);
+	glBufferData(GL_ARRAY_BUFFER, bakedInstances.size() * sizeof(BakedInstance), bakedInstances.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-void drawRobot()
+	glState.uniform1i(instanced, GL_TRUE);
+	glState.uniform1i(baked, GL_TRUE);
+	glUniform1f(bakedTime, renderClock);
+	glState.bindTexture(BAKED_POSE_UNIT, GL_TEXTURE_BUFFER, m_shape.bakedPoseTexture);
+	submitInstanced(m_shape.bakedVAO, pointBakedInstances);
+}
+
+void drawCrowd()
 {
-	bodyDO.drawSelf();
-	headDO.drawSelf();
-	leftHornDO.drawSelf();
-	RigftHornDO.drawSelf();
-	leftUpperarmDO.drawSelf();
-	leftForearmDO.drawSelf();
-	rightUpperarmDO.drawSelf();
-	rightForearmDO.drawSelf();
-	leftThighDO.drawSelf();
-	leftCalfDO.drawSelf();
-	rightThighDO.drawSelf();
-	rightCalfDO.drawSelf();
+	int count = std::min(crowdCount, CROWD_MAX_ROBOTS);
+	if (bakedCrowd && !bakedPartSpheres.empty())
+	{
+		drawInstanced(1);
+		drawBakedCrowd(count);
+	}
+	else
+		drawInstanced(count);
 }
 
+// Turn and step the robot by the keys held; returns whether it is walking
 bool robotMove()
 {	
 	float rotateSpeed = 5.4f;
 	float walkSpeed = 0.18f / (float)walkEnabledCount;
-	vec4 walkVector = walkSpeed * vec4(1.0f, 0.0f, 0.0f, 0.0f);
-	vec3 tempBodyShift = bodyDO.shift;
+	vec3 walkVector = walkSpeed * vec3(1.0f, 0.0f, 0.0f);
+	vec3 tempPosition = robotPosition;
+	quat facing = eulerOrientation(0.0f, robotFacing, 0.0f);
 	vec2 rotateVector = vec2(0.0f);
 	if (keyPressing[GLFW_KEY_D])
 	{
 		rotateVector = rotateVector + vec2(sin(radians(cameraRotate.onZ)) / (float)walkEnabledCount, cos(radians(cameraRotate.onZ)) / (float)walkEnabledCount);
-		bodyDO.shift = bodyDO.shift - vec3(bodyDO.rotateMatrix * walkVector);
+		robotPosition = robotPosition - facing * walkVector;
 	}
 	if (keyPressing[GLFW_KEY_A])
 	{
 		rotateVector = rotateVector + vec2(sin(radians(cameraRotate.onZ + 180.0f)) / (float)walkEnabledCount, cos(radians(cameraRotate.onZ + 180.0f)) / (float)walkEnabledCount);
-		bodyDO.shift = bodyDO.shift - vec3(bodyDO.rotateMatrix * walkVector);
+		robotPosition = robotPosition - facing * walkVector;
 	}
 	if (keyPressing[GLFW_KEY_W])
 	{
 		rotateVector = rotateVector + vec2(sin(radians(cameraRotate.onZ + 270.0f)) / (float)walkEnabledCount, cos(radians(cameraRotate.onZ + 270.0f)) / (float)walkEnabledCount);
-		bodyDO.shift = bodyDO.shift - vec3(bodyDO.rotateMatrix * walkVector);
+		robotPosition = robotPosition - facing * walkVector;
 	}
 	if (keyPressing[GLFW_KEY_S])
 	{
 		rotateVector = rotateVector + vec2(sin(radians(cameraRotate.onZ + 90.0f)) / (float)walkEnabledCount, cos(radians(cameraRotate.onZ + 90.0f)) / (float)walkEnabledCount);
-		bodyDO.shift = bodyDO.shift - vec3(bodyDO.rotateMatrix * walkVector);
+		robotPosition = robotPosition - facing * walkVector;
 	}
 
 	if (length(rotateVector) == 0)
 	{
-		bodyDO.shift = tempBodyShift;
+		robotPosition = tempPosition;
 		return false;
 	}
 	else
 	{
-		float sinRotateZ = sin(radians(bodyDO.rotate.onZ) - atan(rotateVector.y, rotateVector.x));
+		float sinRotateZ = sin(radians(robotFacing) - atan(rotateVector.y, rotateVector.x));
 		if (sinRotateZ > 0)
-			bodyDO.rotate.onZ -= rotateSpeed;
+			robotFacing -= rotateSpeed;
 		else
-			bodyDO.rotate.onZ += rotateSpeed;
+			robotFacing += rotateSpeed;
 		return true;
 	}
 }
 
-void animateWalk(bool is_walking)
+ClipBlender robotAnimator;
+
+// Pose the simulated robot from its clips. The root's clip pose is relative to where the
+// robot stands and faces, so clips never need to know either.
+void animateRobot(bool is_walking)
+{
+	const AnimationClip* clip = sakanaEnabled ? sakanaClip : is_walking ? walkClip : idleClip;
+	robotAnimator.play(clip, CLIP_FADE_TIME);
+	robotAnimator.advance(1.0f / SIM_TICK_RATE);
+
+	robotHierarchy.reset();
+	robotAnimator.sample(robotHierarchy.shifts.data(), robotHierarchy.orientations.data(), robotHierarchy.nodes.size());
+	int root = bodyDO.index;
+	quat facing = eulerOrientation(0.0f, robotFacing, 0.0f);
+	robotHierarchy.shifts[root] = robotPosition + facing * robotHierarchy.shifts[root];
+	robotHierarchy.orientations[root] = facing * robotHierarchy.orientations[root];
+}
+
+// Every clip in ANIMATION_DIR, by file name. The robot's controls play walk, stand and
+// sakana; any other clip can stand in for stand from the GUI.
+void loadAnimations()
+{
+	vector<string> joints;
+	for (DrawObject* node : robotHierarchy.nodes)
+		joints.push_back(node->name);
+	vector<string> paths;
+	error_code error;
+	for (const filesystem::directory_entry& entry : filesystem::directory_iterator(ANIMATION_DIR, error))
+		if (entry.path().extension() == ".anim")
+			paths.push_back(entry.path().string());
+	sort(paths.begin(), paths.end());
+
+	for (const string& path : paths)
+	{
+		AnimationClip clip;
+		if (loadAnimationClip(path, joints, clip))
+			animationClips.push_back(move(clip));
+	}
+	for (const AnimationClip& clip : animationClips)
+	{
+		if (clip.name == "walk")
+			walkClip = &clip;
+		else if (clip.name == "stand")
+			standClip = &clip;
+		else if (clip.name == "sakana")
+			sakanaClip = &clip;
+		for (const JointTrack& track : clip.tracks)
+			if (!track.rotates && robotHierarchy.parents[track.joint] >= 0)
+				for (const vec3& shift : track.shifts)
+					robotShiftReach = std::max(robotShiftReach, length(shift));
+	}
+	idleClip = standClip;
+	if (walkClip == NULL || standClip == NULL || sakanaClip == NULL)
+		cout << "Missing walk, stand or sakana animation in " << ANIMATION_DIR << endl;
+	printf("Loaded %zu animation clips\n", animationClips.size());
+}
+
+// Pose a copy of the rig at BAKED_CLIP_SAMPLES + 1 evenly spaced times of every clip, its
+// start and end included so the shader always has a next sample to blend to, and upload
+// the parts' model matrices as a texture buffer of four texels each. The shader's clip
+// table gets each clip's cycles per second and whether it loops.
+void loadBakedPoses()
 {
-	isStanding = false;
-	float circle = 0.175f;
-	float walkCircle = radians(walkTimerCount / circle);
-	if (!is_walking)
+	int clipCount = std::min((int)animationClips.size(), BAKED_MAX_CLIPS);
+	TransformHierarchy rig = robotHierarchy.clone();
+	int partCount = rig.nodes.size();
+	vector<mat4> matrices;
+	vector<vec2> clipTable;
+	vec3 center = rig.translates[0];
+	float radius = 0.0f;
+	bakedPartSpheres.clear();
+	for (int c = 0; c < clipCount; ++c)
 	{
-		float loopValueSin = sin(walkCircle);
-		float loopValueCos = cos(walkCircle);
-		if (abs(loopValueSin) <= 0.1)
+		const AnimationClip& clip = animationClips[c];
+		ClipPlayer player;
+		player.start(&clip);
+		for (int sample = 0; sample <= BAKED_CLIP_SAMPLES; ++sample)
 		{
-			walkTimerCount = 0;
-			isStanding = true;
+			player.time = clip.length * sample / BAKED_CLIP_SAMPLES;
+			rig.reset();
+			player.sample(rig.shifts.data(), rig.orientations.data());
+			rig.update();
+			rig.updateBounds();
+			matrices.insert(matrices.end(), rig.modelMatrices.begin(), rig.modelMatrices.end());
+			for (const vec4& sphere : rig.worldSpheres)
+				radius = std::max(radius, distance(center, vec3(sphere)) + sphere.w);
+			if (sample == 0)
+				bakedPartSpheres.insert(bakedPartSpheres.end(), rig.worldSpheres.begin(), rig.worldSpheres.end());
 		}
-		else if (loopValueSin * loopValueCos > 0)
-			walkTimerCount -= 1.0f;
-		else
-			walkTimerCount += 1.0f;
+		clipTable.push_back(vec2(1.0f / clip.length, clip.looping ? 1.0f : 0.0f));
+		if (&clip == walkClip)
+			bakedCrowdClip = c;
 	}
-	else
-		walkTimerCount += 1.0f;
+	bakedBounds = vec4(center, radius);
+	if (matrices.empty())
+		matrices.assign(partCount, mat4(1.0f));
+
+	glGenBuffers(1, &m_shape.bakedPoseBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, m_shape.bakedPoseBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, matrices.size() * sizeof(mat4), matrices.data(), GL_STATIC_DRAW);
+	glGenTextures(1, &m_shape.bakedPoseTexture);
+	glActiveTexture(GL_TEXTURE0 + BAKED_POSE_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, m_shape.bakedPoseTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_shape.bakedPoseBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	glState.uniform1i(glGetUniformLocation(program, "bakedPoses"), BAKED_POSE_UNIT);
+	glState.uniform1i(glGetUniformLocation(program, "bakedSamples"), BAKED_CLIP_SAMPLES);
+	glState.uniform1i(glGetUniformLocation(program, "bakedParts"), partCount);
+	if (!clipTable.empty())
+		glUniform2fv(glGetUniformLocation(program, "bakedClips"), clipTable.size(), &clipTable[0].x);
+	printf("Baked %d animation clips: %zu part matrices, %.1f KB\n", clipCount, matrices.size(), matrices.size() * sizeof(mat4) / 1024.0);
+}
+
+void rotateCamera()
+{
+	if (keyPressing[GLFW_KEY_LEFT])
+		cameraRotate.onZ += 1.5f;
+	if (keyPressing[GLFW_KEY_RIGHT])
+		cameraRotate.onZ -= 1.5f;
+}
 
-	walkCircle = radians(walkTimerCount / circle);
-	float moveRate = sin(walkCircle);
-	float moveHigh = (sin(2.0f * walkCircle) + 1.0f) / 3.0f; 
+void setCameraView(float rotateZ)
+{
+	view = lookAt(vec3(-10.0f * cos(radians(rotateZ)), 5.0f, -10.0f * sin(radians(rotateZ))), vec3(0.0f, 1.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+}
 
-	leftUpperarmDO.rotate.onY 	= 60.0f * moveRate;
-	rightUpperarmDO.rotate.onY 	= -60.0f * moveRate;
-	leftThighDO.rotate.onY 		= -60.0f * moveRate;
-	rightThighDO.rotate.onY 	= 60.0f * moveRate;
-	leftCalfDO.rotate.onY 		= abs(30.0f * moveRate);
-	rightCalfDO.rotate.onY 		= abs(30.0f * moveRate);
-	bodyDO.shift 				= vec3(bodyDO.shift.x , moveHigh, bodyDO.shift.z);
+RobotPose capturePose()
+{
+	RobotPose pose;
+	robotHierarchy.capture(pose.parts);
+	pose.cameraRotateZ = cameraRotate.onZ;
+	pose.clock = (float)simTicks / SIM_TICK_RATE;
+	return pose;
+}
 
-	if (isStanding)
+RobotPose interpolatePose(const RobotPose& from, const RobotPose& to, float t)
+{
+	RobotPose pose;
+	for (int i = 0; i < ROBOT_PART_COUNT; ++i)
 	{
-		leftForearmDO.rotate.onY = 0.0f;
-		rightForearmDO.rotate.onY = 0.0f;
+		pose.parts[i].shift = glm::mix(from.parts[i].shift, to.parts[i].shift, t);
+		pose.parts[i].orientation = slerpJoint(from.parts[i].orientation, to.parts[i].orientation, t);
 	}
-	else
+	pose.cameraRotateZ = glm::mix(from.cameraRotateZ, to.cameraRotateZ, t);
+	pose.clock = glm::mix(from.clock, to.clock, t);
+	return pose;
+}
+
+// One fixed simulation step: every per-step constant in the controls assumes SIM_TICK_RATE
+void simulate()
+{
+	rotateCamera();
+
+	// The robot stays put while sakana is in or fading out
+	bool is_walking = false;
+	if (walkEnabledCount > 0 && !sakanaEnabled && !robotAnimator.playing(sakanaClip))
+		is_walking = robotMove();
+	animateRobot(is_walking);
+
+	robotHierarchy.update();
+	simTicks++;
+}
+
+void toggleSakana()
+{
+	sakanaEnabled = !sakanaEnabled;
+}
+
+void simulationTick()
+{
+	TraceScope trace("Simulation tick");
+	function<void()> command;
+	while (simCommands.tryPop(command))
+		command();
+
+	{
+		ScopedTimer timer(profiler, ProfileAnimation);
+		simulate();
+	}
+
+	PoseSnapshot& snapshot = poseBuffer.back();
+	snapshot.previous = simPose;
+	simPose = capturePose();
+	snapshot.current = simPose;
+	snapshot.tickTime = chrono::steady_clock::now();
+	snapshot.sakanaEnabled = sakanaEnabled;
+	poseBuffer.publish();
+}
+
+void simulationLoop()
+{
+	tracer.nameThread("Simulation");
+	auto tick = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / SIM_TICK_RATE));
+	auto next = chrono::steady_clock::now();
+	while (simRunning.load())
+	{
+		simulationTick();
+		next += tick;
+		auto now = chrono::steady_clock::now();
+		if (now - next > chrono::duration<double>(SIM_MAX_FRAME_TIME))
+			next = now;		// fell too far behind: drop the missed ticks instead of replaying them
+		this_thread::sleep_until(next);
+	}
+}
+
+// Publish the starting pose, then either tick on a thread of its own or leave it to advanceSimulation()
+void startSimulation(bool threaded)
+{
+	robotAnimator.play(idleClip, 0.0f);
+	animateRobot(false);
+	robotHierarchy.update();
+	simPose = capturePose();
+	PoseSnapshot& snapshot = poseBuffer.back();
+	snapshot.previous = simPose;
+	snapshot.current = simPose;
+	snapshot.tickTime = chrono::steady_clock::now();
+	snapshot.sakanaEnabled = sakanaEnabled;
+	poseBuffer.publish();
+
+	simAccumulator = 0.0;
+	simLastTime = chrono::steady_clock::now();
+	if (threaded)
 	{
-		leftForearmDO.rotate.onY 	= -60.0f;
-		rightForearmDO.rotate.onY 	= -60.0f;
+		simRunning = true;
+		simThread = thread(simulationLoop);
 	}
 }
 
-void animateSakana(float direct)
+void stopSimulation()
 {
-	sakanaTimerCount += direct * 1.0f;
-	float circle = 10.0f;
-	float moveRate = direct * 1.0f / circle;
+	if (simThread.joinable())
+	{
+		simRunning = false;
+		simThread.join();
+	}
+}
 
-	headDO.rotate.onZ 		   += moveRate * 60.0f;
-	bodyDO.rotate.onY 		   += moveRate * 45.0f;
-	bodyDO.shift 			   += moveRate * sakanaShiftVector;
-	leftThighDO.rotate.onY     += moveRate * -45.0f;
-	rightCalfDO.rotate.onY 	   += moveRate * 45.0f;
-	leftUpperarmDO.rotate.onX  += moveRate * degrees(asin(3.0f/8.0f));
-	leftUpperarmDO.rotate.onY  += moveRate * -135.0f;
-	leftUpperarmDO.shift   	   += moveRate * vec3(0.0f, -0.25f, 0.0f);
-	rightUpperarmDO.rotate.onX += moveRate * -degrees(asin(3.0f/8.0f));
-	rightUpperarmDO.rotate.onY += moveRate * -135.0f;
-	rightUpperarmDO.shift      += moveRate * vec3(0.0f, -0.25f, 0.0f);
+// Inline mode: run as many fixed ticks as the elapsed time covers, then return how far
+// the leftover time reaches into the next tick, for interpolating the render pose
+float advanceSimulation()
+{
+	auto now = chrono::steady_clock::now();
+	double elapsed = fixedFrameTime > 0.0 ? fixedFrameTime : chrono::duration<double>(now - simLastTime).count();
+	simLastTime = now;
+	simAccumulator += std::min(elapsed, SIM_MAX_FRAME_TIME);
 
-	if (sakanaTimerCount == circle || sakanaTimerCount == 0.0f)
-		sakanaDone = true;
+	const double tick = 1.0 / SIM_TICK_RATE;
+	while (simAccumulator >= tick)
+	{
+		simulationTick();
+		simAccumulator -= tick;
+	}
+	return (float)(simAccumulator / tick);
 }
 
-void setCameraView()
+// Pose to draw this frame, between the last two published ticks
+RobotPose renderPose()
 {
-	if (keyPressing[GLFW_KEY_LEFT])
-		cameraRotate.onZ += 1.5f;
-	if (keyPressing[GLFW_KEY_RIGHT])
-		cameraRotate.onZ -= 1.5f;
-	view = lookAt(vec3(-10.0f * cos(radians(cameraRotate.onZ)), 5.0f, -10.0f * sin(radians(cameraRotate.onZ))), vec3(0.0f, 1.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+	float t;
+	if (simThread.joinable())
+	{
+		poseBuffer.update();
+		double sinceTick = chrono::duration<double>(chrono::steady_clock::now() - poseBuffer.front().tickTime).count();
+		t = (float)glm::clamp(sinceTick * SIM_TICK_RATE, 0.0, 1.0);
+	}
+	else
+	{
+		t = advanceSimulation();
+		poseBuffer.update();
+	}
+	const PoseSnapshot& snapshot = poseBuffer.front();
+	return interpolatePose(snapshot.previous, snapshot.current, t);
 }
 
-// Called to draw the scene.
 void display()
 {
+	TraceScope trace("display");
 	// Clear display buffer
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);	
-	setCameraView();
-
-	if (!sakanaDone)
 	{
-		if (isStanding)
-		{
-			if (sakanaEnabled)
-				animateSakana(1.0f);
-			else
-				animateSakana(-1.0f);
-		}
-		else
-			animateWalk(false);
+		ScopedTimer timer(profiler, ProfileStreaming);
+		textureStreamer.update();
 	}
-	else if (!(sakanaDone && sakanaEnabled))
-	{
-		bool is_walking = false;
-		if (walkEnabledCount > 0)
-			is_walking = robotMove();
+	glState.beginFrame();
 
-		animateWalk(is_walking);
-	}	
+	RobotPose pose = renderPose();
+	renderHierarchy.apply(pose.parts);
+	renderClock = pose.clock;
+	{
+		ScopedTimer timer(profiler, ProfileCamera);
+		setCameraView(pose.cameraRotateZ);
+		uploadCamera();
+		viewFrustum = Frustum(projection * view);
+		lodCamera = vec3(inverse(view)[3]);
+		lodPixelScale = projection[1][1] * 0.5f * viewportHeight;
+	}
 	
 	// Tell openGL to use the shader program we created before
-	glUseProgram(program);
+	glState.useProgram(program);
+	glState.bindTexture(TEXTURE_ARRAY_UNIT, GL_TEXTURE_2D_ARRAY, m_shape.textureArray);
 
-	drawGrid();
-	drawRobot();
+	updateRobot();
+	renderHierarchy.updateBounds();
+	int gridDraw = queueDraw(mat4(1.0f), m_shape.textureLayers[TextureKuro]);
+	if (!crowdEnabled && !indirectEnabled)
+	{
+		int partCount = renderHierarchy.nodes.size();
+		int partsLeft = renderHierarchy.cull(viewFrustum);
+		cullStats.record(1, partsLeft > 0, partCount, partsLeft, renderHierarchy.selectLods());
+		renderHierarchy.queueDraws();
+	}
+	uploadDraws();
+
+	{
+		ScopedTimer timer(profiler, ProfileGrid, true);
+		drawGrid(gridDraw);
+	}
+	{
+		ScopedTimer timer(profiler, ProfileRobot, true);
+		if (crowdEnabled)
+			drawCrowd();
+		else
+			drawRobot();
+	}
 }
 
 // Setting up viewing matrix
 void reshapeResponse(GLFWwindow *window, int width, int height)
 {
 	glViewport(0, 0, width, height);
+	viewportHeight = std::max(height, 1);
 	
 	float viewportAspect = (float)width / (float)height;
 	projection = perspective(radians(60.0f), viewportAspect, 0.1f, 1000.0f);
@@ -679,30 +2516,18 @@ void reshapeResponse(GLFWwindow *window, int width, int height)
 void resetObjects()
 {
 	cameraRotate.onZ = 0.0f;
-	headDO.reset();
-	bodyDO.reset();
-	leftUpperarmDO.reset();
-	leftForearmDO.reset();
-	rightUpperarmDO.reset();
-	rightForearmDO.reset();
-	leftThighDO.reset();
-	leftCalfDO.reset();
-	rightThighDO.reset();
-	rightCalfDO.reset();
-	walkTimerCount = 0.0f;
-	sakanaTimerCount = 0.0f;
+	robotPosition = vec3(0.0f);
+	robotFacing = 0.0f;
 	sakanaEnabled = false;
-	sakanaDone = true;
+	idleClip = standClip;
+	robotAnimator = ClipBlender();
+	robotAnimator.play(idleClip, 0.0f);
 }
 
-void keyboardResponse(GLFWwindow *window, int key, int scancode, int action, int mods)
+// Keys that drive the robot and camera, applied on the simulation's side
+void simulationKey(int key, int action)
 {
-	printf("Key %d is pressed\n", key);
 	switch (key) {
-		// Exit: Esc
-		case GLFW_KEY_ESCAPE:
-			glfwSetWindowShouldClose(window, true);
-			break;
 		// Robot transform control: W, A, S, D
 		case GLFW_KEY_D:
 			if (action == GLFW_PRESS)
@@ -779,17 +2604,23 @@ void keyboardResponse(GLFWwindow *window, int key, int scancode, int action, int
 			break;
 		// Test key
 		case GLFW_KEY_T:
-			if (action == GLFW_PRESS)
-			{
-				if (!sakanaEnabled)
-					sakanaShiftVector = vec3(bodyDO.rotateMatrix * vec4(vec3(-sin(radians(45.0f)), sin(radians(45.0f)) - 1, 0), 0.0f));
-				sakanaEnabled = !sakanaEnabled;
-				sakanaDone = false;
-			}
+			if (action == GLFW_PRESS) toggleSakana();
 			break;
 		default:
 			break;
 	}
+}
+
+void keyboardResponse(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+	printf("Key %d is pressed\n", key);
+	// Exit: Esc
+	if (key == GLFW_KEY_ESCAPE)
+	{
+		glfwSetWindowShouldClose(window, true);
+		return;
+	}
+	simCommands.push([key, action] { simulationKey(key, action); });
 }	
 
 
@@ -810,33 +2641,39 @@ void mouseResponse(GLFWwindow *window, int button, int action, int mods)
 
 void GUImenu()
 {
+	TraceScope trace("GUImenu");
 	ImGui_ImplOpenGL3_NewFrame();
 	ImGui_ImplGlfw_NewFrame();
 	ImGui::NewFrame();
 
-	ImGui::SetNextWindowSize(ImVec2(150, 50));
+	ImGui::SetNextWindowSize(ImVec2(260, 50));
 	ImGui::SetNextWindowPos(ImVec2(20, 20));
 	ImGui::Begin("Menu", &myGuiActive, ImGuiWindowFlags_MenuBar);
 	if (ImGui::BeginMenuBar())
 	{
 	    if (ImGui::BeginMenu("AnimateSakana"))
 	    {
-	    	if (!sakanaEnabled)
-	    	{
-	    		if (ImGui::MenuItem("Start")) 
-		        { 
-		        	sakanaEnabled = !sakanaEnabled;
-					sakanaDone = false;
-					sakanaShiftVector = vec3(bodyDO.rotateMatrix * vec4(vec3(-sin(radians(45.0f)), sin(radians(45.0f)) - 1, 0), 0.0f));
-		        }
-	    	}
-	    	else
+	    	if (ImGui::MenuItem(poseBuffer.front().sakanaEnabled ? "End" : "Start")) 
+	    		simCommands.push(toggleSakana);
+	        ImGui::EndMenu();
+	    }
+	    if (ImGui::BeginMenu("Idle"))
+	    {
+	    	for (const AnimationClip& clip : animationClips)
+	    		if (ImGui::MenuItem(clip.name.c_str()))
+	    		{
+	    			const AnimationClip* chosen = &clip;
+	    			simCommands.push([chosen] { idleClip = chosen; });
+	    		}
+	        ImGui::EndMenu();
+	    }
+	    if (ImGui::BeginMenu("Skin"))
+	    {
+	    	for (const char* path : skinPaths)
 	    	{
-	    		if (ImGui::MenuItem("End")) 
-		        { 
-		        	sakanaEnabled = !sakanaEnabled;
-					sakanaDone = false;
-		        }
+	    		const char* name = strrchr(path, '/') + 1;
+	    		if (ImGui::MenuItem(name))
+	    			textureStreamer.request(TextureTorso, path);
 	    	}
 	        ImGui::EndMenu();
 	    }
@@ -846,17 +2683,268 @@ void GUImenu()
 
 	ImGui::End();
 
+	ImGui::SetNextWindowPos(ImVec2(20, 80), ImGuiCond_FirstUseEver);
+	ImGui::Begin("Crowd", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+	ImGui::Checkbox("Instanced crowd", &crowdEnabled);
+	ImGui::Checkbox("Indirect draws", &indirectEnabled);
+	ImGui::Checkbox("Frustum culling", &cullingEnabled);
+	ImGui::Checkbox("Level of detail", &lodEnabled);
+	bool batched = batchedTransforms;
+	if (ImGui::Checkbox("Batched transforms", &batched))
+		batchedTransforms = batched;
+	ImGui::Checkbox("Baked crowd animation", &bakedCrowd);
+	if (bakedCrowd && bakedCrowdClip < (int)animationClips.size() && ImGui::BeginCombo("Crowd clip", animationClips[bakedCrowdClip].name.c_str()))
+	{
+		for (int c = 0; c < std::min((int)animationClips.size(), BAKED_MAX_CLIPS); ++c)
+			if (ImGui::Selectable(animationClips[c].name.c_str(), c == bakedCrowdClip))
+				bakedCrowdClip = c;
+		ImGui::EndCombo();
+	}
+	ImGui::Text("Drawn: %d/%d robots, %d/%d parts", cullStats.visibleRobots, cullStats.robots, cullStats.visibleParts, cullStats.parts);
+	ImGui::Text("Triangles: %lld", (long long)cullStats.triangles);
+	ImGui::SliderInt("Robots", &crowdCount, 1, CROWD_MAX_ROBOTS);
+	ImGui::Text("%.1f FPS (%.2f ms/frame)", ImGui::GetIO().Framerate, 1000.0f / ImGui::GetIO().Framerate);
+	ImGui::End();
+
+	profiler.drawWindow();
+
+	// Appends to the profiler window
+	ImGui::Begin("Profiler");
+	bool tracing = tracer.enabled;
+	if (ImGui::Checkbox("Record trace", &tracing))
+		tracer.enabled = tracing;
+	ImGui::SameLine();
+	if (ImGui::Button("Save trace"))
+		tracer.write(tracePath.c_str());
+	glState.drawStats();
+	ImGui::End();
+
+	ScopedTimer timer(profiler, ProfileImGui, true);
 	ImGui::Render();
 	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+// Scripted input for headless runs. Events fire at a fraction of the run so any
+// frame count plays the whole walk / turn / sakana sequence.
+struct ScriptedKey
+{
+	float at;
+	int key;
+	int action;
+};
+
+const ScriptedKey headlessScript[] = {
+	{ 0.00f, GLFW_KEY_W, GLFW_PRESS },		// walk forward
+	{ 0.20f, GLFW_KEY_D, GLFW_PRESS },		// turn while walking
+	{ 0.30f, GLFW_KEY_D, GLFW_RELEASE },
+	{ 0.45f, GLFW_KEY_W, GLFW_RELEASE },	// settle, then sakana in and out
+	{ 0.50f, GLFW_KEY_T, GLFW_PRESS },
+	{ 0.75f, GLFW_KEY_T, GLFW_PRESS },
+};
+
+int runHeadless()
+{
+	HeadlessContext context;
+	if (!context.create(INIT_VIEWPORT_WIDTH, INIT_VIEWPORT_HEIGHT, textureFormat == TextureFormatSRGB8))
+		return -1;
+	glProcAddress = context.procAddress();
+
+	// #opt-debug
+	dumpInfo();
+
+	initialization();
+	reshapeResponse(NULL, context.width, context.height);
+
+	// One tick per frame keeps every run, and every dumped frame, identical
+	fixedFrameTime = 1.0 / SIM_TICK_RATE;
+	startSimulation(false);
+
+	int eventCount = sizeof(headlessScript) / sizeof(headlessScript[0]);
+	int nextEvent = 0;
+	vector<double> frameTimes;
+	for (int frame = 0; frame < headlessFrames; ++frame)
+	{
+		while (nextEvent < eventCount && headlessScript[nextEvent].at * headlessFrames <= frame)
+		{
+			keyboardResponse(NULL, headlessScript[nextEvent].key, 0, headlessScript[nextEvent].action, 0);
+			nextEvent++;
+		}
+
+		auto frameStart = chrono::steady_clock::now();
+		profiler.beginFrame();
+		display();
+		glFinish();		// count the GPU work too, as a swap would
+		frameTimes.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - frameStart).count());
+		if (frame == 0)
+			printf("Time to first frame: %.1f ms (%d loader threads)\n", chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count(), loaderThreads);
+
+		if (find(headlessDumpFrames.begin(), headlessDumpFrames.end(), frame) != headlessDumpFrames.end())
+		{
+			string path = headlessDumpDir + "/frame_" + to_string(frame) + ".png";
+			vector<unsigned char> pixels = context.readPixels();
+			if (writePNG(path.c_str(), context.width, context.height, pixels.data()))
+				printf("Wrote %s\n", path.c_str());
+			else
+				cout << "Failed to write " << path << endl;
+		}
+	}
+
+	if (!frameTimes.empty())
+	{
+		double total = 0.0;
+		for (double time : frameTimes)
+			total += time;
+		sort(frameTimes.begin(), frameTimes.end());
+		printf("Headless: %d frames in %.1f ms, %.3f ms/frame average, %.3f ms median, %.3f ms worst\n", (int)frameTimes.size(), total, 
+			total / frameTimes.size(), frameTimes[frameTimes.size() / 2], frameTimes.back());
+	}
+	profiler.report();
+	glState.report();
+	if (cullStats.frames > 0)
+	{
+		printf("Culling: %.1f of %.1f parts drawn per frame\n", (double)cullStats.totalVisibleParts / cullStats.frames, (double)cullStats.totalParts / cullStats.frames);
+		printf("Triangles: %.1f drawn per frame\n", (double)cullStats.totalTriangles / cullStats.frames);
+	}
+
+	context.destroy();
+	return 0;
+}
+
+// Time posing copies robots the way the renderer does, every joint slerped between two
+// keys and then update(), glm products per part against the batch kernel, and check that
+// both give the same matrices
+void benchmarkTransforms(int copies)
+{
+	const int frames = 200;
+	vector<quat> keys;
+	for (int key = 0; key < 120; ++key)
+		keys.push_back(jointRotation(RotateType(0.25f * key, 0.5f * key, (float)key - 60.0f)));
+	TransformHierarchy rigs[2] = { robotHierarchy.replicate(copies), robotHierarchy.replicate(copies) };
+	double msPerUpdate[2], msSlerp = 0.0;
+	for (int mode = 0; mode < 2; ++mode)
+	{
+		TransformHierarchy& rig = rigs[mode];
+		chrono::steady_clock::duration slerping(0), updating(0);
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			auto start = chrono::steady_clock::now();
+			for (size_t i = 0; i < rig.orientations.size(); ++i)
+			{
+				size_t key = (frame * 7 + i) % (keys.size() - 1);
+				rig.orientations[i] = slerpJoint(keys[key], keys[key + 1], 0.3f);
+			}
+			auto slerped = chrono::steady_clock::now();
+			if (mode == 1)
+				rig.updateBatched();
+			else
+				rig.updateEach();
+			slerping += slerped - start;
+			updating += chrono::steady_clock::now() - slerped;
+		}
+		msPerUpdate[mode] = chrono::duration<double, milli>(updating).count() / frames;
+		msSlerp += chrono::duration<double, milli>(slerping).count() / frames / 2;
+	}
+
+	float difference = 0.0f;
+	for (size_t i = 0; i < rigs[0].modelMatrices.size(); ++i)
+		for (int col = 0; col < 4; ++col)
+		{
+			vec4 delta = abs(rigs[0].modelMatrices[i][col] - rigs[1].modelMatrices[i][col]);
+			difference = std::max(difference, std::max(std::max(delta.x, delta.y), std::max(delta.z, delta.w)));
+		}
+	printf("Transform update of %d robots (%zu joints), %d frames:\n", copies, rigs[0].nodes.size(), frames);
+	printf("  slerp          %8.3f ms/frame\n", msSlerp);
+	printf("  glm per part   %8.3f ms/update\n", msPerUpdate[0]);
+	printf("  batch kernel   %8.3f ms/update (%.2fx)\n", msPerUpdate[1], msPerUpdate[0] / msPerUpdate[1]);
+	printf("  largest model matrix difference %g\n", difference);
+}
+
 int main(int argc, char **argv)
 {
+	for (int i = 1; i < argc; ++i)
+	{
+		// --float-vertices: keep 32-bit float texcoords and normals in the vertex buffers
+		if (strcmp(argv[i], "--float-vertices") == 0)
+			vertexLayout = VertexLayoutFloat;
+		// --texture-format=rgba8|srgb|compressed: internal format policy for loadTextures()
+		else if (strcmp(argv[i], "--texture-format=srgb") == 0)
+			textureFormat = TextureFormatSRGB8;
+		else if (strcmp(argv[i], "--texture-format=compressed") == 0)
+			textureFormat = TextureFormatCompressed;
+		else if (strcmp(argv[i], "--texture-format=rgba8") == 0)
+			textureFormat = TextureFormatRGBA8;
+		// --loader-threads=N: worker threads decoding models and textures at startup
+		else if (strncmp(argv[i], "--loader-threads=", 17) == 0)
+			loaderThreads = std::max(atoi(argv[i] + 17), 1);
+		// --headless [--frames=N] [--dump-frames=A,B,...] [--dump-dir=DIR]: offscreen scripted run, no window
+		else if (strcmp(argv[i], "--headless") == 0)
+			headless = true;
+		else if (strncmp(argv[i], "--frames=", 9) == 0)
+			headlessFrames = std::max(atoi(argv[i] + 9), 1);
+		else if (strncmp(argv[i], "--dump-frames=", 14) == 0)
+		{
+			for (const char* frame = argv[i] + 14; *frame != '\0'; )
+			{
+				headlessDumpFrames.push_back(atoi(frame));
+				const char* comma = strchr(frame, ',');
+				frame = comma != NULL ? comma + 1 : frame + strlen(frame);
+			}
+		}
+		else if (strncmp(argv[i], "--dump-dir=", 11) == 0)
+			headlessDumpDir = argv[i] + 11;
+		// --trace[=path]: capture a Chrome trace from startup, written at exit (default trace.json)
+		else if (strcmp(argv[i], "--trace") == 0 || strncmp(argv[i], "--trace=", 8) == 0)
+		{
+			traceAtExit = true;
+			tracer.enabled = true;
+			if (argv[i][7] == '=')
+				tracePath = argv[i] + 8;
+		}
+		// --no-indirect: draw robot parts one by one instead of from an indirect command buffer
+		else if (strcmp(argv[i], "--no-indirect") == 0)
+			indirectEnabled = false;
+		// --no-culling: draw every robot and part, even outside the view frustum
+		else if (strcmp(argv[i], "--no-culling") == 0)
+			cullingEnabled = false;
+		// --no-lod: draw every part with its full-detail mesh
+		else if (strcmp(argv[i], "--no-lod") == 0)
+			lodEnabled = false;
+		// --scalar-transforms: compose rig matrices part by part with glm instead of the batch kernel
+		else if (strcmp(argv[i], "--scalar-transforms") == 0)
+			batchedTransforms = false;
+		// --baked-crowd: crowd robots play the walk clip from poses baked on the GPU
+		else if (strcmp(argv[i], "--baked-crowd") == 0)
+			bakedCrowd = true;
+		// --bench-transforms[=N]: time both transform paths on N robots (default 1000) and exit
+		else if (strcmp(argv[i], "--bench-transforms") == 0 || strncmp(argv[i], "--bench-transforms=", 19) == 0)
+		{
+			benchmarkTransforms(argv[i][18] == '=' ? std::max(atoi(argv[i] + 19), 1) : 1000);
+			return 0;
+		}
+		// --crowd=N: start in crowd mode with N robots
+		else if (strncmp(argv[i], "--crowd=", 8) == 0)
+		{
+			crowdEnabled = true;
+			crowdCount = std::min(std::max(atoi(argv[i] + 8), 1), CROWD_MAX_ROBOTS);
+		}
+	}
+
+	tracer.nameThread("Render");
+	if (headless)
+	{
+		int result = runHeadless();
+		if (traceAtExit)
+			tracer.write(tracePath.c_str());
+		return result;
+	}
+
 	// initial glfw
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (textureFormat == TextureFormatSRGB8)
+		glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
 
 	// create window
 	GLFWwindow* window = glfwCreateWindow(INIT_WIDTH, INIT_HEIGHT, "GPA2022_Assignment1", NULL, NULL);
@@ -885,7 +2973,8 @@ int main(int argc, char **argv)
 	glfwSetMouseButtonCallback(window, mouseResponse);
 	
 	// load OpenGL function pointer
-	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+	glProcAddress = (GLADloadproc)glfwGetProcAddress;
+	if (!gladLoadGLLoader(glProcAddress))
 	{
 		cout << "Failed to initialize GLAD" << endl;
 		return -1;
@@ -895,21 +2984,38 @@ int main(int argc, char **argv)
 	dumpInfo();
 
 	initialization();
+	startSimulation(true);
 
 	// main loop
+	bool firstFrame = true;
 	while (!glfwWindowShouldClose(window))
 	{
 		// Poll input event
 		glfwPollEvents();
+
+		profiler.beginFrame();
 				
 		display();
 
 		GUImenu();
 
 		// swap buffer from back to front
-		glfwSwapBuffers(window);
+		{
+			TraceScope trace("glfwSwapBuffers");
+			glfwSwapBuffers(window);
+		}
+
+		if (firstFrame)
+		{
+			printf("Time to first frame: %.1f ms (%d loader threads)\n", chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count(), loaderThreads);
+			firstFrame = false;
+		}
 	}
 	
+	stopSimulation();
+	if (traceAtExit)
+		tracer.write(tracePath.c_str());
+
 	// cleanup imgui
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();